@@ -0,0 +1,172 @@
+/**
+ * 归并内核与败者树的性能对比
+ * 生成k(2、4)个有序段，分别用败者树、标量归并内核、SIMD归并内核归并，输出每秒归并的记录数
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+
+#include "simd_merge.h"
+
+#define BENCH_ITEMS     (4 * 1024 * 1024)   // 参与归并的总记录数
+#define BENCH_REPEAT    5                   // 重复次数，取最快的一次
+
+/* 内存中的有序段 */
+struct run_st {
+    const long long *data;
+    int length;
+    int pos;
+};
+
+static int ltree[SIMD_MERGE_WAYS];          // 败者树
+
+static long long head(struct run_st *runs, int i) {
+    return runs[i].pos < runs[i].length ? runs[i].data[runs[i].pos] : LLONG_MAX;
+}
+
+/* 与 data_sort.c 中的 adjust 相同，值中已含下标，不会出现相等的情况 */
+static void adjust(struct run_st *runs, int nums, int current) {
+    int t = (nums + current) / 2;
+    int tmp;
+
+    while (t != 0) {
+        if (current == -1)
+            break;
+        if (ltree[t] == -1 || head(runs, current) > head(runs, ltree[t])) {
+            tmp = current;
+            current = ltree[t];
+            ltree[t] = tmp;
+        }
+        t /= 2;
+    }
+    ltree[0] = current;
+}
+
+static long long *loserTreeMerge(long long *buf, const int *lens, int k, long long *out) {
+    struct run_st runs[SIMD_MERGE_WAYS];
+    int i, off, n = 0;
+
+    for (i = 0, off = 0; i < k; i++) {
+        runs[i].data = buf + off;
+        runs[i].length = lens[i];
+        runs[i].pos = 0;
+        off += lens[i];
+    }
+    for (i = 0; i < k; i++)
+        ltree[i] = -1;
+    for (i = k - 1; i >= 0; i--)
+        adjust(runs, k, i);
+
+    while (n < off) {
+        out[n++] = runs[ltree[0]].data[runs[ltree[0]].pos++];
+        adjust(runs, k, ltree[0]);
+    }
+    return out;
+}
+
+/* 两两归并的顺序与 simd_merge_segments 相同 */
+static long long *pairMerge(void (*kernel)(const long long *, int, const long long *, int, long long *),
+                            long long *buf, const int *lens, int k, long long *out) {
+    int n01 = lens[0] + lens[1];
+
+    kernel(buf, lens[0], buf + lens[0], lens[1], out);
+    if (k == 2)
+        return out;
+    kernel(buf + n01, lens[2], buf + n01 + lens[2], lens[3], out + n01);
+    kernel(out, n01, out + n01, lens[2] + lens[3], buf);
+    return buf;
+}
+
+static long long *scalarMerge(long long *buf, const int *lens, int k, long long *out) {
+    return pairMerge(simd_merge_scalar, buf, lens, k, out);
+}
+
+static long long *kernelMerge(long long *buf, const int *lens, int k, long long *out) {
+    return pairMerge(simd_merge, buf, lens, k, out);
+}
+
+static int cmpValue(const void *a, const void *b) {
+    long long x = *(const long long *) a, y = *(const long long *) b;
+    return (x > y) - (x < y);
+}
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * 多次运行某种归并方法，返回最快一次的耗时
+ */
+static double bench(long long *(*func)(long long *, const int *, int, long long *),
+                    const long long *input, long long *buf, const int *lens, int k, long long *out,
+                    const long long *expect) {
+    double best = 1e30, start, cost;
+    long long *result = NULL;
+    int i;
+
+    for (i = 0; i < BENCH_REPEAT; i++) {
+        memcpy(buf, input, BENCH_ITEMS * sizeof(*buf));
+        start = now();
+        result = func(buf, lens, k, out);
+        cost = now() - start;
+        if (cost < best)
+            best = cost;
+    }
+    if (memcmp(result, expect, BENCH_ITEMS * sizeof(*result)) != 0)
+        fprintf(stderr, "%d ways: wrong result\n", k);
+    return best;
+}
+
+int main(void) {
+    long long *input, *buf, *out, *expect;
+    int lens[SIMD_MERGE_WAYS];
+    int ways[] = {2, 4};
+    int w, k, i, off;
+    double t;
+
+    input = malloc(BENCH_ITEMS * sizeof(*input));
+    buf = malloc(BENCH_ITEMS * sizeof(*buf));
+    out = malloc(BENCH_ITEMS * sizeof(*out));
+    expect = malloc(BENCH_ITEMS * sizeof(*expect));
+    if (input == NULL || buf == NULL || out == NULL || expect == NULL) {
+        perror("malloc()");
+        exit(1);
+    }
+
+    printf("kernel: %s, %d records\n", simd_merge_avx2() ? "avx2" : "scalar", BENCH_ITEMS);
+    printf("%-6s %14s %14s %14s\n", "ways", "loser tree", "scalar", "simd");
+
+    srand(1);
+    for (w = 0; w < sizeof(ways) / sizeof(ways[0]); w++) {
+        k = ways[w];
+        // 生成k个有序段，下标即在全部记录中的位置
+        for (i = 0; i < BENCH_ITEMS; i++)
+            input[i] = SIMD_PACK(rand(), i);
+        for (i = 0, off = 0; i < k; i++) {
+            lens[i] = BENCH_ITEMS / k;
+            qsort(input + off, lens[i], sizeof(*input), cmpValue);
+            off += lens[i];
+        }
+        memcpy(expect, input, BENCH_ITEMS * sizeof(*input));
+        qsort(expect, BENCH_ITEMS, sizeof(*expect), cmpValue);
+
+        printf("%-6d", k);
+        t = bench(loserTreeMerge, input, buf, lens, k, out, expect);
+        printf(" %9.1f Mr/s", BENCH_ITEMS / t / 1e6);
+        t = bench(scalarMerge, input, buf, lens, k, out, expect);
+        printf(" %9.1f Mr/s", BENCH_ITEMS / t / 1e6);
+        t = bench(kernelMerge, input, buf, lens, k, out, expect);
+        printf(" %9.1f Mr/s\n", BENCH_ITEMS / t / 1e6);
+    }
+
+    free(expect);
+    free(out);
+    free(buf);
+    free(input);
+    exit(0);
+}
@@ -4,16 +4,50 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #include "data_sort.h"
 #include "mypipe.h"
+#include "key_index.h"
+#include "simd_merge.h"
 
 #define BUFSIZE     1024
 #define BUCKETSIZE  10      // 基数排序个数
+#define MIN_NATURAL_RUN 64  // 批次内自然有序段的最短长度，更短的视为无序
+#define SAMPLE_PREFIX   "./tmp/tmp_s"   // 样本排序桶文件名前缀
+#define MANIFEST        "./tmp/manifest.dat"    // 检查点清单
+#define MANIFEST_TEMP   MANIFEST ".tmp"         // 清单先写入该文件，落盘后再改名
+#define MANIFEST_MAGIC  "SORTMANIFEST1"
+#define CHECKSUM_INIT   2166136261U     // FNV-1a 初始值
+#define MERGE_BLOCK     4096            // 块归并时每个归并段缓冲的记录条数(不超过65536)
+#define CHUNK_SORT_MIN  (4 * ITEMSPERFILE)  // 记录数不少于该值时分块排序
 
 /* 记录输入输出文件的结构体 */
 struct file_sort_st {
     FILE *sfp, *dfp;
+    long long presorted;    // 生成归并段时无需排序的记录条数
+    long long limit;        // Top-K：最多输出的记录条数，-1表示不限制
+    int ranged;             // 是否只保留key在[lo, hi]内的记录
+    int lo, hi;
+    key_index_writer_t *index;  // 结果文件的稀疏索引，NULL表示不生成
+    const char *output;         // 结果文件路径，NULL表示未知
+    const struct combine_st *combine;   // 相同key的合并策略，NULL表示保留全部记录
+    int checkpoint;         // 是否记录检查点(计算校验和、落盘、写清单)
+};
+
+/* 正在写的有序文件(归并段或结果文件) */
+struct run_file_st {
+    FILE *fp;
+    unsigned int checksum;  // 已写内容的校验和，只在开启检查点时计算
+    long long bytes;        // 已写的字节数
+};
+
+/* 相同key的合并策略 */
+struct combine_st {
+    void (*prepare)(struct item_st *item);                          // 解析出新记录后的处理，可为NULL
+    void (*combine)(struct item_st *dst, const struct item_st *src); // src(后出现)合并到dst(先出现)中
 };
 
 /* 基数排序桶 */
@@ -28,6 +62,37 @@ struct merge_sort_st {
     struct item_st item;    // 当前读取到的内容
     long long rtimes;             // 需要读取的次数
     long long times;              // 已经读取的次数
+    int over;                     // 是否已读完
+};
+
+/* 归并的输出 */
+struct merge_out_st {
+    struct run_file_st *dfd;    // 归并生成的有序文件
+    struct item_st out;         // 待输出的记录，与后续相同key的记录合并后再写
+    int has_out;
+    long long written;          // 已写入的记录条数
+};
+
+/* 块归并时每个归并段的缓冲区 */
+struct merge_block_st {
+    struct item_st items[MERGE_BLOCK];
+    int n;                      // 缓冲的记录条数
+    int pos;                    // 已输出的记录条数
+};
+
+/* Top-K堆中的记录 */
+struct top_item_st {
+    struct item_st *item;
+    long long seq;              // 读入的次序，key相同时先读入的记录排在前面
+};
+
+/* 样本排序需要的数据结构 */
+struct sample_sort_st {
+    int splitters[MAX_BUCKETS - 1];     // 分割点，桶i存放 splitters[i-1] <= key < splitters[i] 的记录
+    int nbuckets;                       // 桶个数
+    FILE *bfp[MAX_BUCKETS];             // 桶文件指针
+    long long items[MAX_BUCKETS];       // 每个桶中记录的条数
+    int undeal_bucket;                  // 未有线程排序的桶起始号
 };
 
 static pthread_t rtid;                 // 读线程，从文件中读数据到pipe
@@ -36,17 +101,53 @@ static mypipe_t *mypipe;               // 读写者缓冲区
 
 static struct itemRepository_st itemsRep[MAX_MERGE_SEM];    // 归并段(记录仓库、文件个数)
 static long long temp_file_items[MAX_MERGE_SEM];            // 归并文件中记录的条数
+static long long temp_file_bytes[MAX_MERGE_SEM];            // 归并文件的字节数
+static unsigned int temp_file_sums[MAX_MERGE_SEM];          // 归并文件的校验和
 static int undealrep_no = 0;                                // 未有线程操作的rep起始号(也是初始归并段个数)
 static pthread_mutex_t repmut = PTHREAD_MUTEX_INITIALIZER;
 static int round = 1;                                       // 用于生成临时文件名：轮数
 
-static int ltree[MAX_MERGE_WAYS];                           // 败者树
+static struct sample_sort_st sampler;                       // 样本排序的桶信息
+
+static struct top_item_st *topItems;                        // Top-K：各写线程堆中剩余的记录
+static long long topCount = 0;                              // Top-K：topItems中的记录个数
 
 static void* readTask(void *p);                             // 读任务：从文件中读入数据写入缓冲区pipe
 static void *writeTask(void *p);                            // 写任务：从pipe中取数据生成归并段
+static void *heapTask(void *p);                             // Top-K任务：从pipe中取数据维护大小为K的堆
 static void radixSort(struct item_st **pSt, int length);    // 对归并段进行基数排序
-static void createLoserTree(struct merge_sort_st **runs, int nums); // 创建败者树
-static void adjust(struct merge_sort_st **runs, int nums, int current); // 调整败者树
+static void createLoserTree(int *ltree, struct merge_sort_st **runs, int nums); // 创建败者树
+static void chunkSort(struct item_st **pSt, int length);    // 分块排序，块间用归并内核合并
+static void mergeChunks(struct item_st **pSt, int length, int *lens, int k); // 合并相邻的有序段
+static void adjust(int *ltree, struct merge_sort_st **runs, int nums, int current); // 调整败者树
+static void appendFile(FILE *dfp, const char *fileName);    // 将文件内容追加到目标文件
+static void appendResult(struct file_sort_st *me, const char *fileName); // 将有序文件追加到结果文件
+static void saveManifest(struct file_sort_st *me, int runRound, int nruns); // 写检查点清单
+static void *partitionTask(void *p);                        // 分发任务：从pipe中取数据写入对应的桶文件
+static void *sortTask(void *p);                             // 桶排序任务：对桶文件进行内存排序
+static void sortBucket(struct file_sort_st *me, const char *fileName, long long nitems, int depth); // 对一个桶文件排序
+
+static void combineFirst(struct item_st *dst, const struct item_st *src) {
+}
+
+static void combineLast(struct item_st *dst, const struct item_st *src) {
+    strcpy(dst->value, src->value);
+}
+
+static void prepareCount(struct item_st *item) {
+    strcpy(item->value, "1");
+}
+
+static void combineCount(struct item_st *dst, const struct item_st *src) {
+    sprintf(dst->value, "%lld", atoll(dst->value) + atoll(src->value));
+}
+
+/* 合并策略表，下标为 COMBINE_* */
+static const struct combine_st combines[] = {
+    [COMBINE_FIRST] = {NULL, combineFirst},
+    [COMBINE_LAST]  = {NULL, combineLast},
+    [COMBINE_COUNT] = {prepareCount, combineCount},
+};
 
 /**
  * 归并段是否生成结束
@@ -82,6 +183,127 @@ static struct item_st *getItem() {
     return me;
 }
 
+/**
+ * key是否在需要保留的范围内
+ */
+static int inRange(struct file_sort_st *me, int key) {
+    return !me->ranged || (key >= me->lo && key <= me->hi);
+}
+
+/**
+ * 计算校验和(FNV-1a)
+ * @param sum 之前内容的校验和
+ * @param buf 新内容
+ * @param len 新内容的字节数
+ * @return 新的校验和
+ */
+static unsigned int checksum(unsigned int sum, const char *buf, size_t len) {
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        sum ^= (unsigned char) buf[i];
+        sum *= 16777619U;
+    }
+    return sum;
+}
+
+/**
+ * 创建一个待写的有序文件
+ * @param run       有序文件结构体
+ * @param fileName  文件名
+ */
+static void createRun(struct run_file_st *run, const char *fileName) {
+    run->fp = fopen(fileName, "w");
+    if (run->fp == NULL) {
+        perror("fopen()");
+        exit(1);
+    }
+    run->checksum = CHECKSUM_INIT;
+    run->bytes = 0;
+}
+
+/**
+ * 将已打开的文件(如结果文件)作为有序文件写入
+ */
+static void attachRun(struct run_file_st *run, FILE *fp) {
+    run->fp = fp;
+    run->checksum = CHECKSUM_INIT;
+    run->bytes = 0;
+}
+
+/**
+ * 写完有序文件，落盘推迟到登记检查点清单之前(见saveManifest)
+ */
+static void closeRun(struct run_file_st *run) {
+    fclose(run->fp);
+}
+
+/**
+ * 写一条记录，写入结果文件时同时登记到稀疏索引
+ * @param me    sort_init得到的结构体
+ * @param run   目标有序文件
+ * @param item  记录
+ */
+static void writeItem(struct file_sort_st *me, struct run_file_st *run, const struct item_st *item) {
+    char buf[BUFSIZE];
+    int len;
+
+    len = snprintf(buf, BUFSIZE, "%d %s\n", item->key, item->value);
+    if (len >= BUFSIZE)
+        len = BUFSIZE - 1;
+    fwrite(buf, 1, len, run->fp);
+    if (me->checkpoint)
+        run->checksum = checksum(run->checksum, buf, len);
+    run->bytes += len;
+    if (run->fp == me->dfp && me->index != NULL)
+        key_index_add(me->index, item->key, len);
+}
+
+/**
+ * 读取缓冲区pipe得到Item，跳过不在key范围内的记录
+ * @return
+ */
+static struct item_st *getFilteredItem(struct file_sort_st *me) {
+    struct item_st *item;
+
+    while ((item = getItem()) != NULL) {
+        if (inRange(me, item->key))
+            break;
+        free(item);
+    }
+    if (item != NULL && me->combine != NULL && me->combine->prepare != NULL)
+        me->combine->prepare(item);
+    return item;
+}
+
+/**
+ * 合并有序数组中相同key的记录，保留的记录按序放在数组前部，
+ * 被合并掉的记录移到数组后部(仍由调用者释放)
+ * @param me        sort_init得到的结构体
+ * @param pSt       有序数组的首地址
+ * @param length    数组的长度
+ * @return 保留的记录个数
+ */
+static int combineItems(struct file_sort_st *me, struct item_st **pSt, int length) {
+    struct item_st *tmp;
+    int i, n = 0;
+
+    if (me->combine == NULL || length <= 0)
+        return length;
+
+    for (i = 1; i < length; i++) {
+        if (pSt[i]->key == pSt[n]->key) {
+            me->combine->combine(pSt[n], pSt[i]);
+        } else {
+            n++;
+            tmp = pSt[n];
+            pSt[n] = pSt[i];
+            pSt[i] = tmp;
+        }
+    }
+    return n + 1;
+}
+
 file_sort_t *sort_init(FILE *sfp, FILE *dfp) {
     struct file_sort_st *me;
 
@@ -90,6 +312,14 @@ file_sort_t *sort_init(FILE *sfp, FILE *dfp) {
         return NULL;
     me->sfp = sfp;
     me->dfp = dfp;
+    me->presorted = 0;
+    me->limit = -1;
+    me->ranged = 0;
+    me->lo = me->hi = 0;
+    me->index = NULL;
+    me->output = NULL;
+    me->combine = NULL;
+    me->checkpoint = 0;
 
     mypipe = mypipe_init();
     if (mypipe == NULL) {
@@ -113,7 +343,7 @@ void get_merge_segments(file_sort_t *ptr) {
 
     // 写线程: 从pipe中取
     for (i = 0; i < THREAD_NUM; i++) {
-        err = pthread_create(&wtid[i], NULL, writeTask, NULL);
+        err = pthread_create(&wtid[i], NULL, writeTask, ptr);
         if (err) {
             pthread_join(rtid, NULL);
             for (j = 0; j < i; j++)
@@ -127,11 +357,74 @@ void get_merge_segments(file_sort_t *ptr) {
     for (i = 0; i < THREAD_NUM; i++)
         pthread_join(wtid[i], NULL);
 
+    saveManifest(ptr, round, undealrep_no - 1);     // 初始归并段全部生成，记录检查点
     round++;
 }
 
+/**
+ * 当前使用的合并策略编号
+ */
+static int combinePolicy(struct file_sort_st *me) {
+    return me->combine != NULL ? (int) (me->combine - combines) : COMBINE_NONE;
+}
+
+int sort_set_combine(file_sort_t *ptr, int policy) {
+    struct file_sort_st *me = ptr;
+
+    if (policy == COMBINE_NONE) {
+        me->combine = NULL;
+        return 0;
+    }
+    if (policy < 0 || policy >= sizeof(combines) / sizeof(combines[0]) || combines[policy].combine == NULL)
+        return -1;
+    me->combine = &combines[policy];
+    return 0;
+}
+
+int sort_set_index(file_sort_t *ptr, const char *path, int every) {
+    struct file_sort_st *me = ptr;
+
+    me->index = key_index_create(path, every);
+    return me->index != NULL ? 0 : -1;
+}
+
+void sort_set_checkpoint(file_sort_t *ptr, int on) {
+    struct file_sort_st *me = ptr;
+
+    me->checkpoint = on;
+}
+
+void sort_set_output(file_sort_t *ptr, const char *path) {
+    struct file_sort_st *me = ptr;
+
+    me->output = path;
+}
+
+void sort_set_limit(file_sort_t *ptr, long long k) {
+    struct file_sort_st *me = ptr;
+
+    me->limit = k;
+}
+
+void sort_set_range(file_sort_t *ptr, int lo, int hi) {
+    struct file_sort_st *me = ptr;
+
+    me->ranged = 1;
+    me->lo = lo;
+    me->hi = hi;
+}
+
+long long sort_presorted_items(file_sort_t *ptr) {
+    struct file_sort_st *me = ptr;
+
+    return me->presorted;
+}
 
 void sort_destory(file_sort_t *ptr) {
+    struct file_sort_st *me = ptr;
+
+    if (me->index != NULL && key_index_close(me->index) < 0)
+        fprintf(stderr, "key_index_close() failed\n");
 
     pthread_mutex_destroy(&repmut);
     mypipe_destroy(mypipe);
@@ -173,14 +466,93 @@ static void* readTask(void *p) {
     pthread_exit(NULL);
 }
 
+/**
+ * 翻转归并段中的记录
+ * @param pSt       数组的首地址
+ * @param length    数组的长度
+ */
+static void reverseItems(struct item_st **pSt, int length) {
+    struct item_st *tmp;
+    int i, j;
+
+    for (i = 0, j = length - 1; i < j; i++, j--) {
+        tmp = pSt[i];
+        pSt[i] = pSt[j];
+        pSt[j] = tmp;
+    }
+}
+
+/**
+ * 翻转非升序的自然有序段，相同key的记录翻转后再逐组翻转回来，保持原有次序
+ * @param pSt       数组的首地址
+ * @param length    数组的长度
+ */
+static void reverseRun(struct item_st **pSt, int length) {
+    int i, j;
+
+    reverseItems(pSt, length);
+    for (i = 0; i < length; i = j) {
+        j = i + 1;
+        while (j < length && pSt[j]->key == pSt[i]->key)
+            j++;
+        reverseItems(pSt + i, j - i);
+    }
+}
+
+/**
+ * 对一批记录排序：找出批次内不短于 MIN_NATURAL_RUN 的自然有序段，非降序段原样保留，
+ * 非升序段翻转；只有夹在其间的无序部分进行基数排序，最后用归并内核将各段合并
+ * @param pSt       数组的首地址
+ * @param length    数组的长度
+ * @return 位于自然有序段中、无需基数排序的记录条数
+ */
+static int sortBatch(struct item_st **pSt, int length) {
+    int lens[ITEMSPERFILE / MIN_NATURAL_RUN * 2 + 2];    // 各段长度，自然有序段与无序部分交替出现
+    int i, j, desc, disorder = 0, k = 0, presorted = 0;
+
+    for (i = 0; i < length; i = j) {
+        j = i + 1;
+        desc = j < length && pSt[j]->key < pSt[i]->key;
+        while (j < length && (desc ? pSt[j]->key <= pSt[j - 1]->key : pSt[j]->key >= pSt[j - 1]->key))
+            j++;
+        if (j - i < MIN_NATURAL_RUN)
+            continue;
+
+        if (i > disorder) {     // 之前的无序部分
+            radixSort(pSt + disorder, i - disorder);
+            lens[k++] = i - disorder;
+        }
+        if (desc)
+            reverseRun(pSt + i, j - i);
+        lens[k++] = j - i;
+        presorted += j - i;
+        disorder = j;
+    }
+    if (length > disorder) {
+        radixSort(pSt + disorder, length - disorder);
+        lens[k++] = length - disorder;
+    }
+
+    mergeChunks(pSt, length, lens, k);
+    return presorted;
+}
+
 /**
  * 从缓冲区pipe取数据，生成归并段，并排序后写入临时文件
+ * 批次内的自然有序段无需基数排序(见sortBatch)；批次满后，
+ * 不小于当前最大key的后续记录直接追加到该归并段，有序输入只会生成很少的归并段
  */
 static void *writeTask(void *p) {
+    struct file_sort_st *me = p;
     int deal_no;    // 当前处理的是第几个归并段
     struct item_st *item = NULL;
-    int i;
-    FILE *tfp;
+    struct item_st *pending = NULL;     // 打断升序段的记录，留作下一个归并段的开头
+    struct itemRepository_st *rep;
+    struct item_st tail;                // 归并段最后一条记录，升序段延伸时可能还要与后续记录合并
+    int i, kept;
+    long long nitems;                   // 当前归并段实际写入的条数
+    long long presorted = 0;            // 走快速路径的记录条数
+    struct run_file_st run;
     char fileName[BUFSIZE];
 
     mypipe_register(mypipe, MYPIPE_READ);
@@ -195,44 +567,77 @@ static void *writeTask(void *p) {
         undealrep_no++;
         pthread_mutex_unlock(&repmut);
 
-        i = 0;
-        while (1) {
-            item = getItem();
+        rep = &itemsRep[deal_no];
+        while (rep->length < ITEMSPERFILE) {
+            if (pending != NULL) {
+                item = pending;
+                pending = NULL;
+            } else {
+                item = getFilteredItem(me);
+            }
             if (item == NULL)   // 读取结束
                 break;
-            itemsRep[deal_no].items[i] = item;
-            itemsRep[deal_no].length++;
-            if (itemsRep[deal_no].length == ITEMSPERFILE)
-                break;
-            i++;
+            rep->items[rep->length++] = item;
         }
 
-        if (itemsRep[deal_no].length <= 0) {
+        if (rep->length <= 0) {
             break;
         }
 
-        // 对每个归并段进行基数排序
-        radixSort(itemsRep[deal_no].items, itemsRep[deal_no].length);
+        // 只对自然有序段之外的部分进行基数排序
+        presorted += sortBatch(rep->items, rep->length);
 
         // 写入文件
         sprintf(fileName, "./tmp/tmp_r%d_%d.dat", round, deal_no);
-        tfp = fopen(fileName, "w");
-        if (tfp == NULL) {
-            perror("fopen()");
-            exit(1);
+        createRun(&run, fileName);
+
+        // 合并相同key的记录；Top-K时每个归并段只需保留前K条
+        kept = combineItems(me, rep->items, rep->length);
+        tail = *rep->items[kept - 1];
+        nitems = 0;
+        for (i = 0; i < kept - 1 && (me->limit < 0 || nitems < me->limit); i++) {
+            writeItem(me, &run, rep->items[i]);
+            nitems++;
         }
 
-        for (i = 0; i < itemsRep[deal_no].length; i++) {
-            fprintf(tfp, "%d %s\n", itemsRep[deal_no].items[i]->key, itemsRep[deal_no].items[i]->value);
+        // 批次满后继续延伸，不小于前一条的记录直接写入
+        if (rep->length == ITEMSPERFILE) {
+            while ((item = getFilteredItem(me)) != NULL) {
+                if (item->key < tail.key) {
+                    pending = item;
+                    break;
+                }
+                if (me->combine != NULL && item->key == tail.key) {
+                    me->combine->combine(&tail, item);
+                } else {
+                    if (me->limit < 0 || nitems < me->limit) {
+                        writeItem(me, &run, &tail);
+                        nitems++;
+                    }
+                    tail = *item;
+                }
+                free(item);
+                presorted++;
+            }
+        }
+        if (me->limit < 0 || nitems < me->limit) {
+            writeItem(me, &run, &tail);
+            nitems++;
         }
-        fflush(tfp);
-        fclose(tfp);
+        closeRun(&run);
 
-        temp_file_items[deal_no] = itemsRep[deal_no].length;
+        temp_file_items[deal_no] = nitems;
+        temp_file_bytes[deal_no] = run.bytes;
+        temp_file_sums[deal_no] = run.checksum;
         // 写入文件后释放对应的空间
-        for (i = 0; i < itemsRep[deal_no].length; i++)
-            free(itemsRep[deal_no].items[i]);
+        for (i = 0; i < rep->length; i++)
+            free(rep->items[i]);
     }
+    free(pending);
+
+    pthread_mutex_lock(&repmut);
+    me->presorted += presorted;
+    pthread_mutex_unlock(&repmut);
 
     mypipe_unregister(mypipe, MYPIPE_READ);
     pthread_exit(NULL);
@@ -259,6 +664,7 @@ static void radixSort(struct item_st **pSt, int length) {
     for (i = 0; i < BUCKETSIZE; i++) {
         bucket[i].no = i;
         bucket[i].head = malloc(sizeof(struct item_st));    // 头结点 不放任何数据
+        bucket[i].head->next = NULL;
         ptail[i] = bucket[i].head;
     }
 
@@ -300,165 +706,1264 @@ static void radixSort(struct item_st **pSt, int length) {
     }
 }
 
+/**
+ * 合并数组中相邻的若干有序段：将key与下标打包后用归并内核两两归并，key相同时下标小的在前
+ * @param pSt       数组的首地址
+ * @param length    数组的长度
+ * @param lens      各有序段的长度(会被修改)
+ * @param k         有序段个数
+ */
+static void mergeChunks(struct item_st **pSt, int length, int *lens, int k) {
+    struct item_st **sorted;
+    long long *packed, *tmp, *swap;
+    int i, j, off;
+
+    if (k <= 1)
+        return;
+
+    sorted = malloc(length * sizeof(*sorted));
+    packed = malloc(length * sizeof(*packed));
+    tmp = malloc(length * sizeof(*tmp));
+    if (sorted == NULL || packed == NULL || tmp == NULL) {
+        perror("malloc()");
+        exit(1);
+    }
+
+    for (i = 0; i < length; i++)
+        packed[i] = SIMD_PACK(pSt[i]->key, i);
+    // 每一趟将相邻的两段归并为一段，段数减半
+    while (k > 1) {
+        for (i = 0, j = 0, off = 0; i < k; i += 2, j++) {
+            if (i + 1 < k) {
+                simd_merge(packed + off, lens[i], packed + off + lens[i], lens[i + 1], tmp + off);
+                lens[j] = lens[i] + lens[i + 1];
+            } else {
+                memcpy(tmp + off, packed + off, lens[i] * sizeof(*tmp));
+                lens[j] = lens[i];
+            }
+            off += lens[j];
+        }
+        k = j;
+        swap = packed;
+        packed = tmp;
+        tmp = swap;
+    }
+    for (i = 0; i < length; i++)
+        sorted[i] = pSt[SIMD_INDEX(packed[i])];
+    memcpy(pSt, sorted, length * sizeof(*pSt));
+
+    free(tmp);
+    free(packed);
+    free(sorted);
+}
+
+/**
+ * 分块排序：分成 SIMD_MERGE_WAYS 块分别基数排序，再用归并内核合并
+ * 记录较少时直接基数排序
+ * @param pSt       待排序数据数组的首地址
+ * @param length    待排序数据数组的长度
+ */
+static void chunkSort(struct item_st **pSt, int length) {
+    int lens[SIMD_MERGE_WAYS];
+    int i, off;
+
+    if (length < CHUNK_SORT_MIN) {
+        radixSort(pSt, length);
+        return;
+    }
+
+    for (i = 0, off = 0; i < SIMD_MERGE_WAYS; i++) {
+        lens[i] = length / SIMD_MERGE_WAYS + (i < length % SIMD_MERGE_WAYS ? 1 : 0);
+        radixSort(pSt + off, lens[i]);
+        off += lens[i];
+    }
+    mergeChunks(pSt, length, lens, SIMD_MERGE_WAYS);
+}
+
 /**
  * 从归并段中读取每个记录
  * @param run 归并段指针
+ * @return 0表示成功，-1表示该归并段已读完
  */
-static void readItem(struct merge_sort_st *run) {
+static int readItem(struct merge_sort_st *run) {
 
     char buf[BUFSIZE];
 
-    fgets(buf, BUFSIZE, run->fp);
-    sscanf(buf, "%d %s\n", &run->item.key, run->item.value);
+    if (run->rtimes >= 0 && run->times >= run->rtimes)
+        return -1;
+    if (fgets(buf, BUFSIZE, run->fp) == NULL)       // 条数未知的归并段以文件结束为准
+        return -1;
+    if (sscanf(buf, "%d %s\n", &run->item.key, run->item.value) != 2)
+        return -1;
     run->times++;
+    return 0;
+}
+
+/**
+ * 输出归并得到的下一条记录：过滤key范围、合并相同key，Top-K时写满K条后停止
+ * 基础文件中的记录也在这里按key范围过滤
+ * @param me    sort_init得到的结构体
+ * @param mo    归并的输出
+ * @param item  归并得到的下一条记录
+ * @return 0表示继续，-1表示已写满K条，归并可以结束
+ */
+static int emitItem(struct file_sort_st *me, struct merge_out_st *mo, const struct item_st *item) {
+    if (!inRange(me, item->key))
+        return 0;
+
+    if (mo->has_out && me->combine != NULL && item->key == mo->out.key) {
+        me->combine->combine(&mo->out, item);
+        return 0;
+    }
+    if (mo->has_out) {
+        if (me->limit >= 0 && mo->written >= me->limit) {
+            mo->has_out = 0;
+            return -1;
+        }
+        writeItem(me, mo->dfd, &mo->out);
+        mo->written++;
+    }
+    mo->out = *item;
+    mo->has_out = 1;
+    return 0;
+}
+
+/**
+ * 块归并：路数不超过 SIMD_MERGE_WAYS 时代替败者树
+ * 每个归并段缓冲一块记录，不超过各未读完归并段缓冲区末尾记录的部分顺序已能确定，
+ * 将其key与(归并段号, 缓冲区下标)打包后用归并内核一起归并，再按序输出
+ * @param me    sort_init得到的结构体
+ * @param runs  归并文件结构体数组指针，每个归并段已读入第一条记录
+ * @param nums  归并文件个数
+ * @param mo    归并的输出
+ */
+static void blockMerge(struct file_sort_st *me, struct merge_sort_st **runs, int nums, struct merge_out_st *mo) {
+    struct merge_block_st *blocks, *b;
+    long long *packed, *tmp;
+    long long bound, v;
+    int lens[SIMD_MERGE_WAYS];
+    int i, j, total, live, stop = 0;
+    unsigned int index;
+
+    blocks = malloc(nums * sizeof(*blocks));
+    packed = malloc(nums * MERGE_BLOCK * sizeof(*packed));
+    tmp = malloc(nums * MERGE_BLOCK * sizeof(*tmp));
+    if (blocks == NULL || packed == NULL || tmp == NULL) {
+        perror("malloc()");
+        exit(1);
+    }
+    for (i = 0; i < nums; i++) {
+        blocks[i].n = blocks[i].pos = 0;
+        if (!runs[i]->over)
+            blocks[i].items[blocks[i].n++] = runs[i]->item;
+    }
+
+    while (!stop) {
+        live = 0;
+        bound = LLONG_MAX;
+        for (i = 0; i < nums; i++) {
+            b = &blocks[i];
+            if (b->pos == b->n) {   // 缓冲区已输出完，重新读入一块
+                b->n = b->pos = 0;
+                while (!runs[i]->over && b->n < MERGE_BLOCK) {
+                    if (readItem(runs[i]) < 0)
+                        runs[i]->over = 1;
+                    else
+                        b->items[b->n++] = runs[i]->item;
+                }
+            }
+            if (b->pos == b->n)
+                continue;
+            live++;
+            // 未读完的归并段，后续记录都不小于其缓冲区末尾的记录
+            if (!runs[i]->over) {
+                v = SIMD_PACK(b->items[b->n - 1].key, (i << 16) | (b->n - 1));
+                if (v < bound)
+                    bound = v;
+            }
+        }
+        if (live == 0)
+            break;
+
+        total = 0;
+        for (i = 0; i < nums; i++) {
+            b = &blocks[i];
+            for (j = b->pos; j < b->n; j++) {
+                v = SIMD_PACK(b->items[j].key, (i << 16) | j);
+                if (v > bound)
+                    break;
+                packed[total++] = v;
+            }
+            lens[i] = j - b->pos;
+            b->pos = j;
+        }
+        simd_merge_segments(packed, lens, nums, tmp);
+
+        for (j = 0; j < total; j++) {
+            index = SIMD_INDEX(packed[j]);
+            if (emitItem(me, mo, &blocks[index >> 16].items[index & 0xFFFF]) < 0) {
+                stop = 1;
+                break;
+            }
+        }
+    }
+
+    free(tmp);
+    free(packed);
+    free(blocks);
+}
+
+/**
+ * 打开一个待归并的归并段并读入第一条记录
+ * @param run       归并段结构体
+ * @param fp        归并段文件指针
+ * @param rtimes    归并段中记录的条数，-1表示以文件结束为准
+ */
+static void startRun(struct merge_sort_st *run, FILE *fp, long long rtimes) {
+    run->fp = fp;
+    run->rtimes = rtimes;
+    run->times = 0;
+    run->over = 0;
+    if (readItem(run) < 0) {
+        run->item.key = -1;
+        run->over = 1;
+    }
+}
+
+/**
+ * 将已打开的若干归并段归并到有序文件中
+ * @param me    sort_init得到的结构体
+ * @param runs  归并文件结构体数组指针，每个归并段已由startRun读入第一条记录
+ * @param nums  归并文件个数
+ * @param dfd   归并生成的有序文件
+ * @return 写入的记录条数，Top-K时写满K条提前结束
+ */
+static long long mergeRuns(struct file_sort_st *me, struct merge_sort_st **runs, int nums, struct run_file_st *dfd) {
+
+    struct merge_out_st mo;
+    int *ltree;                 // 败者树，每次归并单独分配，多个线程可同时归并
+    int i, live_runs = 0;
+
+    for (i = 0; i < nums; i++) {
+        if (!runs[i]->over)
+            live_runs++;
+    }
+
+    mo.dfd = dfd;
+    mo.has_out = 0;
+    mo.written = 0;
+
+    if (nums <= SIMD_MERGE_WAYS) {      // 路数较少时使用块归并，归并内核按CPU选择AVX2或标量实现
+        blockMerge(me, runs, nums, &mo);
+    } else {
+        // 创建败者树
+        ltree = malloc(nums * sizeof(*ltree));
+        if (ltree == NULL) {
+            perror("malloc()");
+            exit(1);
+        }
+        createLoserTree(ltree, runs, nums);
+
+        while (live_runs > 0) {
+            // 将败者数的胜利节点数据写入输出文件
+            if (emitItem(me, &mo, &runs[ltree[0]]->item) < 0)
+                break;
+            if (readItem(runs[ltree[0]]) < 0) {  // 该归并文件读取结束
+                runs[ltree[0]]->item.key = -1;
+                runs[ltree[0]]->over = 1;
+                live_runs--;
+            }
+
+            adjust(ltree, runs, nums, ltree[0]);
+        }
+        free(ltree);
+    }
+    if (mo.has_out && (me->limit < 0 || mo.written < me->limit)) {
+        writeItem(me, dfd, &mo.out);
+        mo.written++;
+    }
+
+    fflush(dfd->fp);
+    return mo.written;
 }
 
 /**
  * 归并
+ * @param me    sort_init得到的结构体
  * @param nums  归并文件的个数
  * @param round 归并文件的文件名轮数
  * @param start 归并文件的文件名起始下标
- * @param dfd   归并生成文件指针
+ * @param dfd   归并生成的有序文件
+ * @param base  已有序的基础文件，作为额外的一个归并段参与归并，可为NULL
+ * @return 写入的记录条数，Top-K时写满K条提前结束
  */
-static void merge(int nums, int round, int start, FILE *dfd) {
+static long long merge(struct file_sort_st *me, int nums, int round, int start, struct run_file_st *dfd, FILE *base) {
 
-    struct merge_sort_st **runs = malloc(nums * sizeof(struct merge_sort_st*));
-    int i;
-    int live_runs;
+    struct merge_sort_st **runs;
+    long long written;
+    FILE *fp;
+    int i, first;
     char fileName[BUFSIZE];
 
-    live_runs = nums;
+    first = base != NULL ? 1 : 0;   // 基础文件固定为第0个归并段
+    nums += first;
+    runs = malloc(nums * sizeof(struct merge_sort_st*));
     // 初始化每个归并段对应的结构体
     for (i = 0; i < nums; i++) {
         runs[i] = malloc(sizeof(struct merge_sort_st));
-        sprintf(fileName, "./tmp/tmp_r%d_%d.dat", round, start + i);
-        runs[i]->fp = fopen(fileName, "r");
-        if (runs[i]->fp == NULL) {
-            fprintf(stderr, "%s fopen(): %s\n", fileName, strerror(errno));
-            exit(1);
-        }
-        runs[i]->rtimes = temp_file_items[start + i];
-        runs[i]->times = 0;
-        if (runs[i]->rtimes != 0) {
-            readItem(runs[i]);
+        if (i < first) {
+            startRun(runs[i], base, -1);    // 基础文件条数未知
         } else {
-            live_runs--;
+            sprintf(fileName, "./tmp/tmp_r%d_%d.dat", round, start + i - first);
+            fp = fopen(fileName, "r");
+            if (fp == NULL) {
+                fprintf(stderr, "%s fopen(): %s\n", fileName, strerror(errno));
+                exit(1);
+            }
+            startRun(runs[i], fp, temp_file_items[start + i - first]);
         }
     }
 
-    // 创建败者树
-    createLoserTree(runs, nums);
-
-    while (live_runs > 0) {
-        // 将败者数的胜利节点数据写入输出文件
-        fprintf(dfd, "%d %s\n", runs[ltree[0]]->item.key, runs[ltree[0]]->item.value);
-        if (runs[ltree[0]]->times >= runs[ltree[0]]->rtimes) {  // 该归并文件读取结束
-            runs[ltree[0]]->item.key = -1;
-            live_runs--;
-        } else {
-            readItem(runs[ltree[0]]);
-        }
-
-        adjust(runs, nums, ltree[0]);
-    }
+    written = mergeRuns(me, runs, nums, dfd);
 
-    fflush(dfd);
     for (i = 0; i < nums; i++) {
-        fclose(runs[i]->fp);
+        if (i >= first)
+            fclose(runs[i]->fp);
         free(runs[i]);
     }
     free(runs);
+
+    return written;
 }
 
 /**
- * 归并排序
- * @param ptr
+ * 多轮归并，直到剩余归并段能一次归并到目标文件
+ * @param me    sort_init得到的结构体
+ * @param base  已有序的基础文件，可为NULL
  */
-void mergeSort(file_sort_t *ptr) {
+static void mergeRounds(struct file_sort_st *me, FILE *base) {
 
-    struct file_sort_st *me = ptr;
     int merge_sem = undealrep_no - 1;   // 归并段的个数
+    int ways;                       // 每次归并的路数
     int count;                      // 归并计数
     int remain;
-    FILE *tmpf;                     // 中间文件指针
-    int i;
-    long long temp;
+    struct run_file_st tmpf;        // 中间文件
+    struct run_file_st result;      // 结果文件
     char fileName[BUFSIZE];
 
-    while (merge_sem > MAX_MERGE_WAYS) {    // 需要归并的段数大于最大能支持的归并路数需要进行多次归并
+    ways = base != NULL ? MAX_MERGE_WAYS - 1 : MAX_MERGE_WAYS;    // 最后一次归并要给基础文件留一路
+    while (merge_sem > ways) {    // 需要归并的段数大于最大能支持的归并路数需要进行多次归并
         count = 0;
         remain = merge_sem;
-        while (1) {
+        while (remain > 0) {
             // 打开一个待写的临时文件
             sprintf(fileName, "./tmp/tmp_r%d_%d.dat", round, count);
-            tmpf = fopen(fileName, "w");
-            if (tmpf == NULL) {
-                perror("fopen()");
-                exit(1);
-            }
-
-            if (remain > MAX_MERGE_WAYS) {
-                merge(MAX_MERGE_WAYS, round - 1, count * 100, tmpf);
-                // 修改 temp_file_items
-                temp = 0;
-                for (i = 0; i < MAX_MERGE_WAYS; i++)
-                    temp += temp_file_items[count * 100 + i];
-                temp_file_items[count] = temp;
-                remain -= MAX_MERGE_WAYS;
-                count++;
-            } else {
-                merge(remain, round - 1, count * 100, tmpf);
-                // 修改 temp_file_items
-                temp = 0;
-                for (i = 0; i < remain; i++)
-                    temp += temp_file_items[count * 100 + i];
-                temp_file_items[count] = temp;
-                count++;
-                break;
-            }
-            fclose(tmpf);
+            createRun(&tmpf, fileName);
+
+            // 修改 temp_file_items
+            temp_file_items[count] = merge(me, remain > ways ? ways : remain, round - 1, count * ways, &tmpf, NULL);
+            closeRun(&tmpf);
+            temp_file_bytes[count] = tmpf.bytes;
+            temp_file_sums[count] = tmpf.checksum;
+            remain -= ways;
+            count++;
         }
+        saveManifest(me, round, count);     // 本轮归并完成，记录检查点
         round++;
         merge_sem = count;
     }
 
-    merge(merge_sem, round - 1, 0, me->dfp);
+    if (merge_sem == 1 && base == NULL) {   // 只有一个归并段(如输入本身有序)
+        sprintf(fileName, "./tmp/tmp_r%d_0.dat", round - 1);
+        // 不需要索引时直接改名为结果文件，否则拷贝
+        if (me->index != NULL || me->output == NULL || rename(fileName, me->output) < 0) {
+            appendResult(me, fileName);
+            fflush(me->dfp);
+        }
+    } else {
+        attachRun(&result, me->dfp);
+        merge(me, merge_sem, round - 1, 0, &result, base);
+    }
+
+    remove(MANIFEST);   // 排序完成，检查点不再需要
 }
 
 /**
- * 创建败者树
- * @param runs 归并文件结构体数组指针
- * @param nums 归并文件个数
+ * 将归并段文件落盘
+ * @param runRound  归并段文件名的轮数
+ * @param no        归并段文件名的下标
  */
-static void createLoserTree(struct merge_sort_st **runs, int nums) {
-    int i;
+static void syncRun(int runRound, int no) {
+    char fileName[BUFSIZE];
+    int fd;
 
-    for (i = 0; i < nums; i++)
-        ltree[i] = -1;
-    for (i = nums - 1; i >= 0; i--)
-        adjust(runs, nums, i);
+    sprintf(fileName, "./tmp/tmp_r%d_%d.dat", runRound, no);
+    fd = open(fileName, O_RDONLY);
+    if (fd < 0) {
+        perror("open()");
+        return;
+    }
+    if (fsync(fd) < 0)
+        perror("fsync()");
+    close(fd);
 }
 
 /**
- * 调整败者树
- * @param runs      归并文件结构体数组指针
- * @param nums      归并文件个数
- * @param current   当前归并文件
+ * 写检查点清单：当前的归并段所在轮数，以及每个归并段的条数、字节数、校验和
+ * 清单登记的归并段先落盘；清单先写入临时文件并落盘，再改名覆盖，保证清单要么是旧的要么是完整的新的
+ * 未开启检查点时什么也不做
+ * @param me        sort_init得到的结构体
+ * @param runRound  归并段文件名的轮数
+ * @param nruns     归并段个数
  */
-static void adjust(struct merge_sort_st **runs, int nums, int current) {
-    int t = (nums + current) / 2;
-    int tmp;
+static void saveManifest(struct file_sort_st *me, int runRound, int nruns) {
+    struct stat st;
+    FILE *fp;
+    int i, fd;
+
+    if (!me->checkpoint)
+        return;
+    for (i = 0; i < nruns; i++)
+        syncRun(runRound, i);
+
+    if (fstat(fileno(me->sfp), &st) < 0) {
+        perror("fstat()");
+        return;
+    }
 
-    while (t != 0) {    // current中一直记录着当前胜者
-        if (current == -1)
-            break;
-        if (ltree[t] == -1 || runs[current]->item.key < 0 ||
-                (runs[ltree[t]]->item.key > 0 && runs[current]->item.key > runs[ltree[t]]->item.key)) {
-            tmp = current;
-            current = ltree[t];
-            ltree[t] = tmp;
-        }
-        t /= 2;
+    fp = fopen(MANIFEST_TEMP, "w");
+    if (fp == NULL) {
+        perror("manifest fopen()");
+        return;
+    }
+    fprintf(fp, "%s\n", MANIFEST_MAGIC);
+    fprintf(fp, "input %lld %lld\n", (long long) st.st_size, (long long) st.st_mtime);
+    fprintf(fp, "config %lld %d %d %d %d\n", me->limit, me->ranged, me->lo, me->hi, combinePolicy(me));
+    fprintf(fp, "round %d\n", runRound);
+    fprintf(fp, "runs %d\n", nruns);
+    for (i = 0; i < nruns; i++)
+        fprintf(fp, "%lld %lld %u\n", temp_file_items[i], temp_file_bytes[i], temp_file_sums[i]);
+    fflush(fp);
+    if (fsync(fileno(fp)) < 0)
+        perror("fsync()");
+    fclose(fp);
+
+    if (rename(MANIFEST_TEMP, MANIFEST) < 0) {
+        perror("rename()");
+        return;
+    }
+    // 目录落盘后改名才是持久的
+    fd = open("./tmp", O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+/**
+ * 校验归并段文件与清单中记录的字节数、校验和是否一致
+ * @return 0表示一致，-1表示不一致
+ */
+static int checkRun(int runRound, int no, long long bytes, unsigned int sum) {
+    FILE *fp;
+    char fileName[BUFSIZE], buf[BUFSIZE];
+    unsigned int s = CHECKSUM_INIT;
+    long long total = 0;
+    size_t len;
+
+    sprintf(fileName, "./tmp/tmp_r%d_%d.dat", runRound, no);
+    fp = fopen(fileName, "r");
+    if (fp == NULL)
+        return -1;
+    while ((len = fread(buf, 1, BUFSIZE, fp)) > 0) {
+        s = checksum(s, buf, len);
+        total += len;
+    }
+    fclose(fp);
+
+    return total == bytes && s == sum ? 0 : -1;
+}
+
+/**
+ * 读取并校验检查点清单，成功时恢复归并段信息
+ * @param me        sort_init得到的结构体
+ * @param fp        清单文件指针
+ * @param runRound  清单中归并段所在的轮数
+ * @return 归并段个数，-1表示清单无效
+ */
+static int loadManifest(struct file_sort_st *me, FILE *fp, int *runRound) {
+    struct stat st;
+    char magic[BUFSIZE];
+    long long size, mtime, limit;
+    int ranged, lo, hi, policy, nruns, i;
+
+    if (fscanf(fp, "%1023s input %lld %lld config %lld %d %d %d %d round %d runs %d",
+               magic, &size, &mtime, &limit, &ranged, &lo, &hi, &policy, runRound, &nruns) != 10)
+        return -1;
+    if (strcmp(magic, MANIFEST_MAGIC) != 0 || nruns < 0 || nruns > MAX_MERGE_SEM)
+        return -1;
+
+    // 源文件与排序参数必须与上一次相同
+    if (fstat(fileno(me->sfp), &st) < 0 || st.st_size != size || st.st_mtime != mtime)
+        return -1;
+    if (limit != me->limit || ranged != me->ranged || lo != me->lo || hi != me->hi || policy != combinePolicy(me))
+        return -1;
+
+    for (i = 0; i < nruns; i++) {
+        if (fscanf(fp, "%lld %lld %u", &temp_file_items[i], &temp_file_bytes[i], &temp_file_sums[i]) != 3)
+            return -1;
+        if (checkRun(*runRound, i, temp_file_bytes[i], temp_file_sums[i]) < 0)
+            return -1;
+    }
+    return nruns;
+}
+
+int sort_resume(file_sort_t *ptr) {
+    FILE *fp;
+    int runRound, nruns;
+
+    fp = fopen(MANIFEST, "r");
+    if (fp == NULL)
+        return -1;
+    nruns = loadManifest(ptr, fp, &runRound);
+    fclose(fp);
+    if (nruns < 0)
+        return -1;
+
+    round = runRound + 1;
+    undealrep_no = nruns + 1;   // 与 get_merge_segments 结束时一致：比归并段个数多1
+    return runRound;
+}
+
+/**
+ * 归并排序
+ * @param ptr
+ */
+void mergeSort(file_sort_t *ptr) {
+    mergeRounds(ptr, NULL);
+}
+
+void mergeIncremental(file_sort_t *ptr, FILE *bfp) {
+    mergeRounds(ptr, bfp);
+}
+
+/**
+ * 创建败者树
+ * @param ltree 败者树，nums个元素
+ * @param runs  归并文件结构体数组指针
+ * @param nums  归并文件个数
+ */
+static void createLoserTree(int *ltree, struct merge_sort_st **runs, int nums) {
+    int i;
+
+    for (i = 0; i < nums; i++)
+        ltree[i] = -1;
+    for (i = nums - 1; i >= 0; i--)
+        adjust(ltree, runs, nums, i);
+}
+
+/**
+ * 调整败者树
+ * @param ltree     败者树
+ * @param runs      归并文件结构体数组指针
+ * @param nums      归并文件个数
+ * @param current   当前归并文件
+ */
+static void adjust(int *ltree, struct merge_sort_st **runs, int nums, int current) {
+    int t = (nums + current) / 2;
+    int tmp;
+
+    while (t != 0) {    // current中一直记录着当前胜者
+        if (current == -1)
+            break;
+        // key相同时归并段号小的(先出现的)胜出，保证归并是稳定的
+        if (ltree[t] == -1 || runs[current]->item.key < 0 ||
+                (runs[ltree[t]]->item.key >= 0 && (runs[current]->item.key > runs[ltree[t]]->item.key ||
+                (runs[current]->item.key == runs[ltree[t]]->item.key && current > ltree[t])))) {
+            tmp = current;
+            current = ltree[t];
+            ltree[t] = tmp;
+        }
+        t /= 2;
     }
     ltree[0] = current;
-}
\ No newline at end of file
+}
+
+/**
+ * 生成桶文件名
+ * @param buf    文件名存放地址
+ * @param prefix 桶文件名前缀
+ * @param no     桶标号
+ */
+static void bucketName(char *buf, const char *prefix, int no) {
+    sprintf(buf, "%s_%d.dat", prefix, no);
+}
+
+/**
+ * 打开桶文件
+ * @param prefix 桶文件名前缀
+ * @param no     桶标号
+ * @param mode   打开方式
+ * @return 文件指针
+ */
+static FILE *openBucket(const char *prefix, int no, const char *mode) {
+    char fileName[BUFSIZE];
+    FILE *fp;
+
+    bucketName(fileName, prefix, no);
+    fp = fopen(fileName, mode);
+    if (fp == NULL) {
+        fprintf(stderr, "%s fopen(): %s\n", fileName, strerror(errno));
+        exit(1);
+    }
+    return fp;
+}
+
+/**
+ * 将文件内容追加到目标文件
+ * @param dfp       目标文件指针
+ * @param fileName  源文件名
+ */
+static void appendFile(FILE *dfp, const char *fileName) {
+    FILE *fp;
+    char buf[BUFSIZE];
+    size_t len;
+
+    fp = fopen(fileName, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "%s fopen(): %s\n", fileName, strerror(errno));
+        exit(1);
+    }
+    while ((len = fread(buf, 1, BUFSIZE, fp)) > 0)
+        fwrite(buf, 1, len, dfp);
+    fclose(fp);
+}
+
+/**
+ * 将有序文件追加到结果文件，需要生成索引时逐条写入
+ * @param me        sort_init得到的结构体
+ * @param fileName  有序文件名
+ */
+static void appendResult(struct file_sort_st *me, const char *fileName) {
+    struct run_file_st result;
+    struct item_st item;
+    FILE *fp;
+    char buf[BUFSIZE];
+
+    if (me->index == NULL) {
+        appendFile(me->dfp, fileName);
+        return;
+    }
+
+    fp = fopen(fileName, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "%s fopen(): %s\n", fileName, strerror(errno));
+        exit(1);
+    }
+    attachRun(&result, me->dfp);
+    while (fgets(buf, BUFSIZE, fp) != NULL) {
+        if (sscanf(buf, "%d %s\n", &item.key, item.value) == 2)
+            writeItem(me, &result, &item);
+    }
+    fclose(fp);
+}
+
+/**
+ * 在文件中等间隔抽取key，使用pread不改变文件偏移
+ * @param fd        文件描述符
+ * @param keys      抽样结果
+ * @param num       希望抽取的个数
+ * @param linelen   抽到的行的平均长度，可为NULL
+ * @return 实际抽到的个数
+ */
+static int sampleKeys(int fd, int *keys, int num, int *linelen) {
+    struct stat st;
+    char buf[BUFSIZE];
+    char *line, *end;
+    ssize_t len;
+    off_t off;
+    long long total = 0;
+    int i, n = 0;
+
+    if (fstat(fd, &st) < 0) {
+        perror("fstat()");
+        exit(1);
+    }
+
+    for (i = 0; i < num && st.st_size > 0; i++) {
+        off = (off_t) (st.st_size * (long long) i / num);
+        len = pread(fd, buf, BUFSIZE - 1, off);
+        if (len <= 0)
+            continue;
+        buf[len] = '\0';
+        line = buf;
+        if (off > 0) {      // 跳过不完整的行
+            line = strchr(buf, '\n');
+            if (line == NULL)
+                continue;
+            line++;
+        }
+        end = strchr(line, '\n');
+        if (end == NULL || sscanf(line, "%d", &keys[n]) != 1)
+            continue;
+        total += end - line + 1;
+        n++;
+    }
+
+    if (linelen != NULL)
+        *linelen = n > 0 ? (int) (total / n) : 0;
+    return n;
+}
+
+static int cmpKey(const void *a, const void *b) {
+    int x = *(const int *) a, y = *(const int *) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * 由样本选出 nbuckets - 1 个分割点
+ * @param keys      样本(会被排序)
+ * @param n         样本个数
+ * @param nbuckets  希望划分的桶个数
+ * @param splitters 分割点
+ * @return 实际的桶个数，1表示无法划分
+ */
+static int chooseSplitters(int *keys, int n, int nbuckets, int *splitters) {
+    int i;
+
+    if (nbuckets > MAX_BUCKETS)
+        nbuckets = MAX_BUCKETS;
+    if (n == 0 || nbuckets < 2)
+        return 1;
+
+    qsort(keys, n, sizeof(int), cmpKey);
+    if (keys[0] == keys[n - 1])     // 样本全部相同，无法再划分
+        return 1;
+    for (i = 1; i < nbuckets; i++)
+        splitters[i - 1] = keys[(long long) i * n / nbuckets];
+    return nbuckets;
+}
+
+/**
+ * 二分查找key所属的桶
+ * @return 桶标号
+ */
+static int findBucket(const int *splitters, int nbuckets, int key) {
+    int lo = 0, hi = nbuckets - 1, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (key < splitters[mid])
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
+}
+
+/**
+ * 从缓冲区pipe取数据，按key范围写入对应的桶文件
+ */
+static void *partitionTask(void *p) {
+    struct file_sort_st *me = p;
+    long long items[MAX_BUCKETS] = {0};     // 本线程写入每个桶的条数
+    char buf[BUFSIZE];
+    int key, no, i;
+
+    mypipe_register(mypipe, MYPIPE_READ);
+    while (mypipe_gets(mypipe, buf, BUFSIZE) >= 0) {
+        if (sscanf(buf, "%d", &key) != 1 || !inRange(me, key))
+            continue;
+        no = findBucket(sampler.splitters, sampler.nbuckets, key);
+        fputs(buf, sampler.bfp[no]);        // 标准IO自带锁，多个线程可同时写
+        items[no]++;
+    }
+    mypipe_unregister(mypipe, MYPIPE_READ);
+
+    pthread_mutex_lock(&repmut);
+    for (i = 0; i < sampler.nbuckets; i++)
+        sampler.items[i] += items[i];
+    pthread_mutex_unlock(&repmut);
+
+    pthread_exit(NULL);
+}
+
+/**
+ * 从桶文件中读入至多max条记录，按序排序(并合并相同key)
+ * @param me     sort_init得到的结构体
+ * @param fp     桶文件指针
+ * @param items  记录存放地址
+ * @param pItems 排序结果，指向items中的记录
+ * @param max    最多读入的条数
+ * @return 排序(合并)后的记录条数，0表示已读完
+ */
+static int loadSorted(struct file_sort_st *me, FILE *fp, struct item_st *items, struct item_st **pItems, int max) {
+    char buf[BUFSIZE];
+    int n = 0;
+
+    while (n < max && fgets(buf, BUFSIZE, fp) != NULL) {
+        if (sscanf(buf, "%d %s\n", &items[n].key, items[n].value) != 2)
+            continue;
+        items[n].next = NULL;
+        if (me->combine != NULL && me->combine->prepare != NULL)
+            me->combine->prepare(&items[n]);
+        pItems[n] = &items[n];
+        n++;
+    }
+
+    if (n > 0)
+        chunkSort(pItems, n);
+    return combineItems(me, pItems, n);     // 数组整体释放，被合并掉的记录无需单独处理
+}
+
+/**
+ * 将桶文件全部读入内存，基数排序(并合并相同key)后写回
+ * @param me       sort_init得到的结构体
+ * @param fileName 桶文件名
+ * @param nitems   桶中记录条数
+ */
+static void sortBucketInMemory(struct file_sort_st *me, const char *fileName, long long nitems) {
+    struct item_st *items, **pItems;
+    FILE *fp;
+    long long i, n;
+
+    if (nitems <= 0)
+        return;
+
+    items = malloc(nitems * sizeof(*items));
+    pItems = malloc(nitems * sizeof(*pItems));
+    if (items == NULL || pItems == NULL) {
+        perror("malloc()");
+        exit(1);
+    }
+
+    fp = fopen(fileName, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "%s fopen(): %s\n", fileName, strerror(errno));
+        exit(1);
+    }
+    n = loadSorted(me, fp, items, pItems, (int) nitems);
+    fclose(fp);
+
+    fp = fopen(fileName, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "%s fopen(): %s\n", fileName, strerror(errno));
+        exit(1);
+    }
+    for (i = 0; i < n; i++)
+        fprintf(fp, "%d %s\n", pItems[i]->key, pItems[i]->value);
+    fclose(fp);
+
+    free(pItems);
+    free(items);
+}
+
+/**
+ * 桶中记录的key是否全部相同
+ * @param fileName 桶文件名
+ * @return 1表示全部相同，0表示不同
+ */
+static int isSingleKey(const char *fileName) {
+    FILE *fp;
+    char buf[BUFSIZE];
+    int key, first, n = 0, same = 1;
+
+    fp = fopen(fileName, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "%s fopen(): %s\n", fileName, strerror(errno));
+        exit(1);
+    }
+    while (same && fgets(buf, BUFSIZE, fp) != NULL) {
+        if (sscanf(buf, "%d", &key) != 1)
+            continue;
+        if (n++ == 0)
+            first = key;
+        else if (key != first)
+            same = 0;
+    }
+    fclose(fp);
+    return same;
+}
+
+/**
+ * 过大且无法再划分的桶按外部排序进行：每次读入 BUCKET_ITEMS 条排序后写入一个子归并段，
+ * 再将各子归并段归并写回原桶文件，内存占用与桶的大小无关
+ * @param me       sort_init得到的结构体
+ * @param fileName 桶文件名
+ * @param nitems   桶中记录条数
+ */
+static void sortBucketExternal(struct file_sort_st *me, const char *fileName, long long nitems) {
+    struct item_st *items, **pItems;
+    struct merge_sort_st *runs;
+    struct merge_sort_st **pRuns;
+    struct run_file_st run;
+    FILE *fp;
+    char prefix[BUFSIZE], name[BUFSIZE];
+    int nruns, maxruns, n, i;
+
+    maxruns = (int) ((nitems + BUCKET_ITEMS - 1) / BUCKET_ITEMS);
+    items = malloc(BUCKET_ITEMS * sizeof(*items));
+    pItems = malloc(BUCKET_ITEMS * sizeof(*pItems));
+    runs = malloc(maxruns * sizeof(*runs));
+    pRuns = malloc(maxruns * sizeof(*pRuns));
+    if (items == NULL || pItems == NULL || runs == NULL || pRuns == NULL) {
+        perror("malloc()");
+        exit(1);
+    }
+
+    // 子归并段文件名前缀：去掉原桶文件名的".dat"
+    sprintf(prefix, "%.*s_m", (int) strlen(fileName) - 4, fileName);
+    fp = fopen(fileName, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "%s fopen(): %s\n", fileName, strerror(errno));
+        exit(1);
+    }
+    for (nruns = 0; nruns < maxruns; nruns++) {
+        n = loadSorted(me, fp, items, pItems, BUCKET_ITEMS);
+        if (n <= 0)
+            break;
+        bucketName(name, prefix, nruns);
+        createRun(&run, name);
+        for (i = 0; i < n; i++)
+            writeItem(me, &run, pItems[i]);
+        closeRun(&run);
+    }
+    fclose(fp);
+    free(pItems);
+    free(items);
+
+    for (i = 0; i < nruns; i++) {
+        pRuns[i] = &runs[i];
+        startRun(pRuns[i], openBucket(prefix, i, "r"), -1);
+    }
+    createRun(&run, fileName);
+    mergeRuns(me, pRuns, nruns, &run);
+    closeRun(&run);
+    for (i = 0; i < nruns; i++)
+        fclose(runs[i].fp);
+
+    free(pRuns);
+    free(runs);
+}
+
+/**
+ * 对过大的桶再次抽样划分，各子桶排序后按序拼接回原桶文件
+ * @param me       sort_init得到的结构体
+ * @param fileName 桶文件名
+ * @param nitems   桶中记录条数
+ * @param depth    当前划分深度
+ * @return 0表示成功，-1表示无法再划分
+ */
+static int splitBucket(struct file_sort_st *me, const char *fileName, long long nitems, int depth) {
+    int keys[SAMPLE_NUM], splitters[MAX_BUCKETS - 1];
+    long long items[MAX_BUCKETS] = {0};
+    FILE *fp, *bfp[MAX_BUCKETS];
+    char prefix[BUFSIZE], name[BUFSIZE], buf[BUFSIZE];
+    int n, nbuckets, i, key;
+
+    fp = fopen(fileName, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "%s fopen(): %s\n", fileName, strerror(errno));
+        exit(1);
+    }
+
+    n = sampleKeys(fileno(fp), keys, SAMPLE_NUM, NULL);
+    nbuckets = chooseSplitters(keys, n, (int) (nitems / BUCKET_ITEMS) + 1, splitters);
+    if (nbuckets < 2) {
+        fclose(fp);
+        return -1;
+    }
+
+    // 子桶文件名前缀：去掉原桶文件名的".dat"
+    sprintf(prefix, "%.*s", (int) strlen(fileName) - 4, fileName);
+    for (i = 0; i < nbuckets; i++)
+        bfp[i] = openBucket(prefix, i, "w");
+    while (fgets(buf, BUFSIZE, fp) != NULL) {
+        if (sscanf(buf, "%d", &key) != 1)
+            continue;
+        i = findBucket(splitters, nbuckets, key);
+        fputs(buf, bfp[i]);
+        items[i]++;
+    }
+    fclose(fp);
+    for (i = 0; i < nbuckets; i++)
+        fclose(bfp[i]);
+
+    for (i = 0; i < nbuckets; i++) {
+        if (items[i] == nitems)     // 全部落入同一个子桶，划分无效
+            return -1;
+    }
+
+    for (i = 0; i < nbuckets; i++) {
+        bucketName(name, prefix, i);
+        sortBucket(me, name, items[i], depth + 1);
+    }
+
+    fp = fopen(fileName, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "%s fopen(): %s\n", fileName, strerror(errno));
+        exit(1);
+    }
+    for (i = 0; i < nbuckets; i++) {
+        bucketName(name, prefix, i);
+        appendFile(fp, name);
+    }
+    fclose(fp);
+
+    return 0;
+}
+
+/**
+ * 对一个桶文件排序，过大的桶先递归划分
+ * 无法再划分的大桶：key全部相同时已经有序，否则按外部排序进行，不整体读入内存
+ * @param me       sort_init得到的结构体
+ * @param fileName 桶文件名
+ * @param nitems   桶中记录条数
+ * @param depth    当前划分深度
+ */
+static void sortBucket(struct file_sort_st *me, const char *fileName, long long nitems, int depth) {
+    if (nitems <= BUCKET_ITEMS) {
+        sortBucketInMemory(me, fileName, nitems);
+        return;
+    }
+    if (depth < MAX_PARTITION_DEPTH && splitBucket(me, fileName, nitems, depth) == 0)
+        return;
+    if (me->combine == NULL && isSingleKey(fileName))
+        return;
+    sortBucketExternal(me, fileName, nitems);
+}
+
+/**
+ * 不断领取未排序的桶进行排序
+ */
+static void *sortTask(void *p) {
+    struct file_sort_st *me = p;
+    char fileName[BUFSIZE];
+    int no;
+
+    while (1) {
+        pthread_mutex_lock(&repmut);
+        no = sampler.undeal_bucket++;
+        pthread_mutex_unlock(&repmut);
+        if (no >= sampler.nbuckets)
+            break;
+
+        bucketName(fileName, SAMPLE_PREFIX, no);
+        sortBucket(me, fileName, sampler.items[no], 0);
+    }
+
+    pthread_exit(NULL);
+}
+
+void sampleSort(file_sort_t *ptr) {
+    struct file_sort_st *me = ptr;
+    pthread_t stid[SORT_THREAD_NUM];
+    struct stat st;
+    int keys[SAMPLE_NUM];
+    int n, linelen, err, i, j;
+    long long estimate = 0;
+    char fileName[BUFSIZE];
+
+    // 抽样并选出分割点，按估计的记录条数决定桶个数
+    n = sampleKeys(fileno(me->sfp), keys, SAMPLE_NUM, &linelen);
+    if (fstat(fileno(me->sfp), &st) == 0 && linelen > 0)
+        estimate = st.st_size / linelen;
+    sampler.nbuckets = chooseSplitters(keys, n, (int) (estimate / BUCKET_ITEMS) + 1, sampler.splitters);
+
+    // 读线程 + 分发线程：一趟将记录写入各个桶文件
+    for (i = 0; i < sampler.nbuckets; i++) {
+        sampler.bfp[i] = openBucket(SAMPLE_PREFIX, i, "w");
+        sampler.items[i] = 0;
+    }
+
+    err = pthread_create(&rtid, NULL, readTask, ptr);
+    if (err) {
+        fprintf(stderr, "pthread_create(): %s\n", strerror(err));
+        exit(1);
+    }
+    for (i = 0; i < THREAD_NUM; i++) {
+        err = pthread_create(&wtid[i], NULL, partitionTask, ptr);
+        if (err) {
+            pthread_join(rtid, NULL);
+            for (j = 0; j < i; j++)
+                pthread_join(wtid[j], NULL);
+            fprintf(stderr, "pthread_create(): %s\n", strerror(err));
+            exit(1);
+        }
+    }
+    pthread_join(rtid, NULL);
+    for (i = 0; i < THREAD_NUM; i++)
+        pthread_join(wtid[i], NULL);
+
+    for (i = 0; i < sampler.nbuckets; i++)
+        fclose(sampler.bfp[i]);
+
+    // 各桶相互独立，多个线程并行排序
+    sampler.undeal_bucket = 0;
+    for (i = 0; i < SORT_THREAD_NUM; i++) {
+        err = pthread_create(&stid[i], NULL, sortTask, ptr);
+        if (err) {
+            for (j = 0; j < i; j++)
+                pthread_join(stid[j], NULL);
+            fprintf(stderr, "pthread_create(): %s\n", strerror(err));
+            exit(1);
+        }
+    }
+    for (i = 0; i < SORT_THREAD_NUM; i++)
+        pthread_join(stid[i], NULL);
+
+    // 按桶的顺序拼接即为有序结果
+    for (i = 0; i < sampler.nbuckets; i++) {
+        bucketName(fileName, SAMPLE_PREFIX, i);
+        appendResult(me, fileName);
+    }
+    fflush(me->dfp);
+}
+
+/**
+ * Top-K记录的比较：先比较key，key相同时比较读入次序
+ * @return a排在b之后时返回正数
+ */
+static int cmpTopItem(const void *a, const void *b) {
+    const struct top_item_st *x = a, *y = b;
+
+    if (x->item->key != y->item->key)
+        return x->item->key > y->item->key ? 1 : -1;
+    return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+/**
+ * 大根堆下沉
+ * @param heap  堆
+ * @param n     堆中元素个数
+ * @param i     下沉的位置
+ */
+static void heapDown(struct top_item_st *heap, long long n, long long i) {
+    struct top_item_st tmp;
+    long long child;
+
+    while ((child = 2 * i + 1) < n) {
+        if (child + 1 < n && cmpTopItem(&heap[child + 1], &heap[child]) > 0)
+            child++;
+        if (cmpTopItem(&heap[i], &heap[child]) >= 0)
+            break;
+        tmp = heap[i];
+        heap[i] = heap[child];
+        heap[child] = tmp;
+        i = child;
+    }
+}
+
+/**
+ * 大根堆上浮
+ * @param heap  堆
+ * @param i     上浮的位置
+ */
+static void heapUp(struct top_item_st *heap, long long i) {
+    struct top_item_st tmp;
+    long long parent;
+
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (cmpTopItem(&heap[parent], &heap[i]) >= 0)
+            break;
+        tmp = heap[i];
+        heap[i] = heap[parent];
+        heap[parent] = tmp;
+        i = parent;
+    }
+}
+
+/**
+ * 从缓冲区pipe取数据，维护key最小的K条记录(大根堆，堆顶为当前第K小)
+ * key相同时按读入次序比较，先读入的记录保留，与外部排序的结果一致
+ */
+static void *heapTask(void *p) {
+    struct file_sort_st *me = p;
+    struct top_item_st *heap;
+    struct item_st *item;
+    long long n = 0, seq = 0, i;
+
+    heap = malloc((me->limit > 0 ? me->limit : 1) * sizeof(*heap));
+    if (heap == NULL) {
+        perror("malloc()");
+        exit(1);
+    }
+
+    mypipe_register(mypipe, MYPIPE_READ);
+    while ((item = getFilteredItem(me)) != NULL) {
+        if (n < me->limit) {
+            heap[n].item = item;
+            heap[n].seq = seq;
+            heapUp(heap, n++);
+        } else if (n > 0 && item->key < heap[0].item->key) {    // 后读入的记录key相同时不会更小
+            free(heap[0].item);
+            heap[0].item = item;
+            heap[0].seq = seq;
+            heapDown(heap, n, 0);
+        } else {
+            free(item);
+        }
+        seq++;
+    }
+    mypipe_unregister(mypipe, MYPIPE_READ);
+
+    pthread_mutex_lock(&repmut);
+    for (i = 0; i < n; i++)
+        topItems[topCount++] = heap[i];
+    pthread_mutex_unlock(&repmut);
+
+    free(heap);
+    pthread_exit(NULL);
+}
+
+void topKSort(file_sort_t *ptr) {
+    struct file_sort_st *me = ptr;
+    struct run_file_st result;
+    int err, i, j;
+    long long k;
+
+    // K过大或需要合并相同key时，按外部排序进行，归并输出K条后提前结束
+    if (me->limit > TOPK_MEM_ITEMS || me->combine != NULL) {
+        get_merge_segments(ptr);
+        mergeSort(ptr);
+        return;
+    }
+
+    topItems = malloc((me->limit * THREAD_NUM + 1) * sizeof(*topItems));
+    if (topItems == NULL) {
+        perror("malloc()");
+        exit(1);
+    }
+
+    err = pthread_create(&rtid, NULL, readTask, ptr);
+    if (err) {
+        fprintf(stderr, "pthread_create(): %s\n", strerror(err));
+        exit(1);
+    }
+    for (i = 0; i < THREAD_NUM; i++) {
+        err = pthread_create(&wtid[i], NULL, heapTask, ptr);
+        if (err) {
+            pthread_join(rtid, NULL);
+            for (j = 0; j < i; j++)
+                pthread_join(wtid[j], NULL);
+            fprintf(stderr, "pthread_create(): %s\n", strerror(err));
+            exit(1);
+        }
+    }
+    pthread_join(rtid, NULL);
+    for (i = 0; i < THREAD_NUM; i++)
+        pthread_join(wtid[i], NULL);
+
+    // 合并各线程的堆：按(key, 读入次序)排序后取前K条
+    qsort(topItems, topCount, sizeof(*topItems), cmpTopItem);
+    k = topCount < me->limit ? topCount : me->limit;
+    attachRun(&result, me->dfp);
+    for (i = 0; i < k; i++)
+        writeItem(me, &result, topItems[i].item);
+    fflush(me->dfp);
+
+    for (i = 0; i < topCount; i++)
+        free(topItems[i].item);
+    free(topItems);
+}
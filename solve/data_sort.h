@@ -10,6 +10,20 @@
 #define THREAD_NUM      1                       // 写线程个数
 
 #define STRLEN          32                      // value 字符串长度
+
+#define COMBINE_NONE    0                       // 相同key：保留全部记录
+#define COMBINE_FIRST   1                       // 相同key：只保留最先出现的记录
+#define COMBINE_LAST    2                       // 相同key：只保留最后出现的记录
+#define COMBINE_COUNT   3                       // 相同key：合并为一条，value为出现次数
+
+#define TOPK_MEM_ITEMS  1000000                 // Top-K：K不超过该值时完全在内存中完成，不产生临时文件
+
+#define SAMPLE_NUM      1000                    // 样本排序：抽样key的个数
+#define BUCKET_ITEMS    500000                  // 样本排序：每个桶期望的条目个数(需能放入内存)
+#define MAX_BUCKETS     128                     // 样本排序：一次划分最多的桶个数
+#define MAX_PARTITION_DEPTH 4                   // 样本排序：倾斜桶递归划分的最大深度
+#define SORT_THREAD_NUM 4                       // 样本排序：桶内排序线程个数
+
 /* 文件中每个条目对应的结构体 */
 struct item_st {
     int key;
@@ -39,12 +53,103 @@ file_sort_t *sort_init(FILE *sfd, FILE *dfd);
  */
 void get_merge_segments(file_sort_t *ptr);
 
+/**
+ * 开启检查点：初始归并段生成完毕以及每一轮归并完成后，把归并段信息写入 ./tmp/manifest.dat
+ * 只有开启时才计算归并段的校验和并落盘，不开启时排序不付出这部分开销
+ * @param ptr sort_init得到的指针
+ * @param on  1表示开启，0表示关闭
+ */
+void sort_set_checkpoint(file_sort_t *ptr, int on);
+
+/**
+ * 从检查点恢复：校验 ./tmp/manifest.dat 中记录的归并段(条数、字节数、校验和)，
+ * 成功后可直接调用 mergeSort / mergeIncremental，从最后完成的一轮继续归并，
+ * 不必再调用 get_merge_segments。源文件或排序参数与上一次不同时清单无效
+ * 上一次排序需开启了检查点(sort_set_checkpoint)
+ * @param ptr sort_init得到的指针
+ * @return 恢复到的归并轮数，-1表示清单不存在或无效
+ */
+int sort_resume(file_sort_t *ptr);
+
 /**
  * 进行归并排序
  * @param ptr sort_init得到的指针
  */
 void mergeSort(file_sort_t *ptr);
 
+/**
+ * 增量归并：将 get_merge_segments 得到的新归并段与已有序的基础文件
+ * (如上一次的排序结果)一起归并，基础文件只被顺序读一遍
+ * @param ptr sort_init得到的指针
+ * @param bfp 已有序的基础文件指针
+ */
+void mergeIncremental(file_sort_t *ptr, FILE *bfp);
+
+/**
+ * 生成归并段时走快速路径(自然有序、无需基数排序)的记录条数
+ * @param ptr sort_init得到的指针
+ * @return 记录条数
+ */
+long long sort_presorted_items(file_sort_t *ptr);
+
+/**
+ * 设置相同key的合并策略：在每个归并段排序后、以及每次归并输出时合并相同key的记录
+ * @param ptr    sort_init得到的指针
+ * @param policy COMBINE_* 之一
+ * @return 0表示成功，-1表示策略不存在
+ */
+int sort_set_combine(file_sort_t *ptr, int policy);
+
+/**
+ * 写结果文件时同时生成稀疏索引：每every条记录登记一个块(最小/最大key、字节偏移)
+ * 索引在 sort_destory 时写完，可用 key_index_open / key_index_lookup 查询
+ * @param ptr   sort_init得到的指针
+ * @param path  索引文件路径
+ * @param every 每个块的记录条数
+ * @return 0表示成功，-1表示失败
+ */
+int sort_set_index(file_sort_t *ptr, const char *path, int every);
+
+/**
+ * 设置结果文件的路径：只有一个归并段(如输入本身有序)且不需要生成索引时，
+ * 直接将该归并段改名为结果文件，不再拷贝。临时目录与结果文件需在同一文件系统，否则仍然拷贝
+ * @param ptr  sort_init得到的指针
+ * @param path 结果文件路径，与sort_init的dfd是同一个文件
+ */
+void sort_set_output(file_sort_t *ptr, const char *path);
+
+/**
+ * 设置Top-K：只输出key最小的K条记录，归并输出K条后提前结束
+ * @param ptr sort_init得到的指针
+ * @param k   最多输出的记录条数，-1表示不限制
+ */
+void sort_set_limit(file_sort_t *ptr, long long k);
+
+/**
+ * 设置key范围：解析时即丢弃key不在[lo, hi]内的记录，只有符合的记录才写入临时文件
+ * @param ptr sort_init得到的指针
+ * @param lo  key下界(包含)
+ * @param hi  key上界(包含)
+ */
+void sort_set_range(file_sort_t *ptr, int lo, int hi);
+
+/**
+ * Top-K排序，K由 sort_set_limit 设置，可代替 get_merge_segments + mergeSort
+ * K不超过 TOPK_MEM_ITEMS 时每个写线程维护一个大小为K的大根堆，不产生临时文件；
+ * 否则进行外部排序，每个归并段只保留前K条
+ * @param ptr sort_init得到的指针
+ */
+void topKSort(file_sort_t *ptr);
+
+/**
+ * 样本排序(分布排序)，可代替 get_merge_segments + mergeSort
+ * 抽样选出分割点，将记录按key范围一趟分发到各个桶文件，
+ * 各桶由多个线程独立在内存中排序，最后按序拼接到目标文件。
+ * 过大的桶(key分布倾斜)会被递归地再次划分
+ * @param ptr sort_init得到的指针
+ */
+void sampleSort(file_sort_t *ptr);
+
 /**
  * 清理现场，释放资源
  * @param ptr sort_init得到的指针
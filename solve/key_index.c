@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "key_index.h"
+
+/* 写索引需要的数据结构 */
+struct key_index_writer_st {
+    FILE *fp;
+    struct key_index_head_st head;
+    struct key_index_entry_st block;    // 正在登记的块
+    long long count;                    // 当前块已登记的条数
+    long long offset;                   // 结果文件已写入的字节数
+};
+
+/* 读索引需要的数据结构 */
+struct key_index_st {
+    void *addr;                         // mmap得到的地址
+    size_t length;                      // 映射长度
+    struct key_index_head_st *head;
+    struct key_index_entry_st *entries;
+};
+
+key_index_writer_t *key_index_create(const char *path, int every) {
+    struct key_index_writer_st *me;
+
+    if (every <= 0)
+        return NULL;
+
+    me = malloc(sizeof(*me));
+    if (me == NULL)
+        return NULL;
+
+    me->fp = fopen(path, "w");
+    if (me->fp == NULL) {
+        free(me);
+        return NULL;
+    }
+
+    memset(&me->head, 0, sizeof(me->head));
+    memcpy(me->head.magic, KEY_INDEX_MAGIC, sizeof(me->head.magic));
+    me->head.every = every;
+    me->count = 0;
+    me->offset = 0;
+
+    // 先占住文件头的位置，关闭时再写入真正的内容
+    if (fwrite(&me->head, sizeof(me->head), 1, me->fp) != 1) {
+        fclose(me->fp);
+        free(me);
+        return NULL;
+    }
+
+    return me;
+}
+
+static int flushBlock(struct key_index_writer_st *me) {
+    if (me->count <= 0)
+        return 0;
+    if (fwrite(&me->block, sizeof(me->block), 1, me->fp) != 1)
+        return -1;
+    me->head.nblocks++;
+    me->count = 0;
+    return 0;
+}
+
+int key_index_add(key_index_writer_t *ptr, int key, long long length) {
+    struct key_index_writer_st *me = ptr;
+
+    if (me->count == 0) {
+        me->block.min_key = key;
+        me->block.max_key = key;
+        me->block.offset = me->offset;
+        me->block.size = 0;
+    }
+    if (key < me->block.min_key)
+        me->block.min_key = key;
+    if (key > me->block.max_key)
+        me->block.max_key = key;
+    me->block.size += length;
+    me->offset += length;
+    me->head.items++;
+    me->count++;
+
+    if (me->count >= me->head.every)
+        return flushBlock(me);
+    return 0;
+}
+
+int key_index_close(key_index_writer_t *ptr) {
+    struct key_index_writer_st *me = ptr;
+    int ret = 0;
+
+    if (flushBlock(me) < 0)
+        ret = -1;
+    if (fseek(me->fp, 0, SEEK_SET) < 0 || fwrite(&me->head, sizeof(me->head), 1, me->fp) != 1)
+        ret = -1;
+    if (fclose(me->fp) != 0)
+        ret = -1;
+    free(ptr);
+    return ret;
+}
+
+key_index_t *key_index_open(const char *path) {
+    struct key_index_st *me;
+    struct stat st;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0 || st.st_size < sizeof(struct key_index_head_st)) {
+        close(fd);
+        return NULL;
+    }
+
+    me = malloc(sizeof(*me));
+    if (me == NULL) {
+        close(fd);
+        return NULL;
+    }
+
+    me->length = st.st_size;
+    me->addr = mmap(NULL, me->length, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (me->addr == MAP_FAILED) {
+        free(me);
+        return NULL;
+    }
+
+    me->head = me->addr;
+    me->entries = (struct key_index_entry_st *) (me->head + 1);
+    // 校验文件标识和长度
+    if (memcmp(me->head->magic, KEY_INDEX_MAGIC, sizeof(me->head->magic)) != 0 || me->head->nblocks < 0 ||
+            me->length < sizeof(*me->head) + me->head->nblocks * sizeof(*me->entries)) {
+        munmap(me->addr, me->length);
+        free(me);
+        return NULL;
+    }
+
+    return me;
+}
+
+int key_index_lookup(key_index_t *ptr, int lo, int hi, long long *offset, long long *size) {
+    struct key_index_st *me = ptr;
+    long long left, right, mid, first, last;
+
+    // 第一个 max_key >= lo 的块
+    left = 0;
+    right = me->head->nblocks;
+    while (left < right) {
+        mid = (left + right) / 2;
+        if (me->entries[mid].max_key < lo)
+            left = mid + 1;
+        else
+            right = mid;
+    }
+    first = left;
+
+    // 最后一个 min_key <= hi 的块
+    left = 0;
+    right = me->head->nblocks;
+    while (left < right) {
+        mid = (left + right) / 2;
+        if (me->entries[mid].min_key <= hi)
+            left = mid + 1;
+        else
+            right = mid;
+    }
+    last = left - 1;
+
+    if (first >= me->head->nblocks || last < first)
+        return -1;
+
+    *offset = me->entries[first].offset;
+    *size = me->entries[last].offset + me->entries[last].size - *offset;
+    return 0;
+}
+
+int key_index_release(key_index_t *ptr) {
+    struct key_index_st *me = ptr;
+    int ret;
+
+    ret = munmap(me->addr, me->length);
+    free(ptr);
+    return ret;
+}
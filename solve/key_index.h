@@ -0,0 +1,79 @@
+/**
+ * 有序结果文件的稀疏索引
+ * 归并写结果文件时每N条记录登记一个块：块内最小/最大key、块的字节偏移和长度；
+ * 查询时将索引文件mmap到内存二分查找，只需对结果文件进行一次定位读取
+ */
+#ifndef DATA_SORT_KEY_INDEX_H
+#define DATA_SORT_KEY_INDEX_H
+
+#define KEY_INDEX_MAGIC     "KEYIDX1"       // 索引文件标识
+
+/* 索引文件头 */
+struct key_index_head_st {
+    char magic[8];
+    long long every;        // 每个块的记录条数
+    long long nblocks;      // 块个数
+    long long items;        // 记录总条数
+};
+
+/* 索引文件中每个块对应的结构体 */
+struct key_index_entry_st {
+    int min_key;            // 块内最小key
+    int max_key;            // 块内最大key
+    long long offset;       // 块在结果文件中的字节偏移
+    long long size;         // 块的字节长度
+};
+
+typedef void key_index_writer_t;
+typedef void key_index_t;
+
+/**
+ * 创建索引文件
+ * @param path  索引文件路径
+ * @param every 每个块的记录条数
+ * @return 失败NULL，成功返回一个指针
+ */
+key_index_writer_t *key_index_create(const char *path, int every);
+
+/**
+ * 登记一条按序写入结果文件的记录
+ * @param ptr    key_index_create返回的指针
+ * @param key    记录的key
+ * @param length 记录在结果文件中占的字节数
+ * @return 0表示成功，-1表示失败
+ */
+int key_index_add(key_index_writer_t *ptr, int key, long long length);
+
+/**
+ * 写入最后一个块和文件头，关闭索引文件
+ * @param ptr key_index_create返回的指针
+ * @return 0表示成功，-1表示失败
+ */
+int key_index_close(key_index_writer_t *ptr);
+
+/**
+ * 打开索引文件(mmap)
+ * @param path 索引文件路径
+ * @return 失败NULL，成功返回一个指针
+ */
+key_index_t *key_index_open(const char *path);
+
+/**
+ * 查找可能包含key在[lo, hi]内记录的字节范围，点查询时lo == hi
+ * @param ptr    key_index_open返回的指针
+ * @param lo     key下界(包含)
+ * @param hi     key上界(包含)
+ * @param offset 字节范围起始偏移
+ * @param size   字节范围长度
+ * @return 0表示找到，-1表示不存在这样的记录
+ */
+int key_index_lookup(key_index_t *ptr, int lo, int hi, long long *offset, long long *size);
+
+/**
+ * 关闭索引，释放资源
+ * @param ptr key_index_open返回的指针
+ * @return 0表示成功，其他均表示失败
+ */
+int key_index_release(key_index_t *ptr);
+
+#endif //DATA_SORT_KEY_INDEX_H
@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "key_index.h"
+
+#define DATAFILE    "./source_data_out.dat"     // 有序结果文件
+#define INDEXFILE   DATAFILE ".idx"             // 稀疏索引文件
+#define CHUNKSIZE   65536                       // 每次读取的字节数，需大于最长的一行
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-d data_file] [-x index_file] lo [hi]\n", name);
+    fprintf(stderr, "  输出key等于lo(或key在[lo, hi]内)的所有记录\n");
+    exit(1);
+}
+
+/**
+ * 输出key在[lo, hi]内的一行
+ * @param line 行首
+ * @param end  行尾(换行符的位置)
+ * @return 该行的key
+ */
+static int printLine(const char *line, const char *end, int lo, int hi) {
+    int key = atoi(line);
+
+    if (key >= lo && key <= hi) {
+        fwrite(line, 1, end - line, stdout);
+        putchar('\n');
+    }
+    return key;
+}
+
+int main(int argc, char **argv) {
+
+    const char *dataFile = DATAFILE, *indexFile = INDEXFILE;
+    key_index_t *index;
+    long long offset, size, pos, want;
+    ssize_t len;
+    char *buf, *line, *end;
+    int c, fd, lo, hi, key, rest = 0, found = 0;
+
+    while ((c = getopt(argc, argv, "d:x:")) != -1) {
+        switch (c) {
+            case 'd':
+                dataFile = optarg;
+                break;
+            case 'x':
+                indexFile = optarg;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind >= argc)
+        usage(argv[0]);
+    lo = atoi(argv[optind]);
+    hi = optind + 1 < argc ? atoi(argv[optind + 1]) : lo;
+
+    index = key_index_open(indexFile);
+    if (index == NULL) {
+        fprintf(stderr, "%s: key_index_open() failed\n", indexFile);
+        exit(1);
+    }
+    if (key_index_lookup(index, lo, hi, &offset, &size) < 0) {
+        key_index_release(index);
+        exit(1);
+    }
+    key_index_release(index);
+
+    fd = open(dataFile, O_RDONLY);
+    if (fd < 0) {
+        perror("open()");
+        exit(1);
+    }
+    buf = malloc(CHUNKSIZE + 1);
+    if (buf == NULL) {
+        perror("malloc()");
+        exit(1);
+    }
+
+    // 从索引给出的偏移处顺序分块读取，内存占用与范围大小无关
+    // rest为上一块末尾不完整的行，移到缓冲区开头与下一块拼接
+    for (pos = 0, key = lo; pos < size && key <= hi; pos += len) {
+        want = size - pos < CHUNKSIZE - rest ? size - pos : CHUNKSIZE - rest;
+        len = pread(fd, buf + rest, want, offset + pos);
+        if (len < 0) {
+            perror("pread()");
+            exit(1);
+        } else if (len == 0) {
+            break;
+        }
+        rest += len;
+
+        for (line = buf; key <= hi && (end = memchr(line, '\n', buf + rest - line)) != NULL; line = end + 1) {
+            *end = '\0';
+            key = printLine(line, end, lo, hi);
+            found |= key >= lo && key <= hi;
+        }
+        rest -= line - buf;
+        memmove(buf, line, rest);
+        if (rest == CHUNKSIZE) {    // 行过长，不再拼接
+            fprintf(stderr, "line too long\n");
+            exit(1);
+        }
+    }
+    if (rest > 0 && key <= hi) {    // 最后一行没有换行符
+        buf[rest] = '\0';
+        key = printLine(buf, buf + rest, lo, hi);
+        found |= key >= lo && key <= hi;
+    }
+    close(fd);
+
+    free(buf);
+    exit(found ? 0 : 1);
+}
@@ -1,15 +1,86 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
 
 #include "data_sort.h"
 
 #define INPUTFILE   "./source_data.dat"       // 源文件位置
 #define OUTPUTFILE  "./source_data_out.dat"
+#define INDEXFILE   OUTPUTFILE ".idx"       // 结果文件的稀疏索引
+#define OUTPUTTEMP  OUTPUTFILE ".tmp"       // 增量模式先写入该文件，完成后再改名
 
-int main() {
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-s] [-i base_file] [-k K] [-r lo,hi] [-x N] [-u first|last|count] [-R]\n", name);
+    fprintf(stderr, "  -s    样本排序模式：按key范围分桶并行排序，不进行多路归并\n");
+    fprintf(stderr, "  -i    增量模式：只对新输入排序，再与已有序的 base_file 归并\n");
+    fprintf(stderr, "  -k    Top-K：只输出key最小的K条记录\n");
+    fprintf(stderr, "  -r    key范围：只输出key在[lo, hi]内的记录\n");
+    fprintf(stderr, "  -x    每N条记录登记一个索引块，生成稀疏索引 " INDEXFILE "\n");
+    fprintf(stderr, "  -u    相同key只输出一条：保留最先(first)/最后(last)出现的记录，或输出出现次数(count)\n");
+    fprintf(stderr, "  -R    记录检查点到 ./tmp/manifest.dat，并从已有的检查点继续归并，清单无效时重新排序(不能与-s、单独的-k同用)\n");
+    exit(1);
+}
 
-    FILE *sfp = NULL, *dfp = NULL;
+int main(int argc, char **argv) {
+
+    FILE *sfp = NULL, *dfp = NULL, *bfp = NULL;
     struct file_sort_t *ptr;
+    int c;
+    int sample = 0;     // 是否使用样本排序
+    char *base = NULL;  // 增量模式的基础文件
+    long long limit = -1;   // Top-K的K
+    int ranged = 0, lo, hi; // key范围
+    int every = 0;          // 索引块的记录条数，0表示不生成索引
+    int policy = COMBINE_NONE;  // 相同key的合并策略
+    int resume = 0;             // 是否从检查点恢复
+    int resumed;
+
+    while ((c = getopt(argc, argv, "si:k:r:x:u:R")) != -1) {
+        switch (c) {
+            case 's':
+                sample = 1;
+                break;
+            case 'i':
+                base = optarg;
+                break;
+            case 'k':
+                limit = atoll(optarg);
+                if (limit < 0)
+                    usage(argv[0]);
+                break;
+            case 'r':
+                if (sscanf(optarg, "%d,%d", &lo, &hi) != 2 || lo > hi)
+                    usage(argv[0]);
+                ranged = 1;
+                break;
+            case 'x':
+                every = atoi(optarg);
+                if (every <= 0)
+                    usage(argv[0]);
+                break;
+            case 'u':
+                if (strcmp(optarg, "first") == 0)
+                    policy = COMBINE_FIRST;
+                else if (strcmp(optarg, "last") == 0)
+                    policy = COMBINE_LAST;
+                else if (strcmp(optarg, "count") == 0)
+                    policy = COMBINE_COUNT;
+                else
+                    usage(argv[0]);
+                break;
+            case 'R':
+                resume = 1;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (sample && (base != NULL || limit >= 0))
+        usage(argv[0]);
+    // 样本排序和内存Top-K不经过归并段，无法从检查点恢复
+    if (resume && (sample || (limit >= 0 && base == NULL)))
+        usage(argv[0]);
 
     // 打开源文件
     sfp = fopen(INPUTFILE, "r");
@@ -18,8 +89,18 @@ int main() {
         exit(1);
     }
 
+    // 打开基础文件，基础文件可以就是上一次的目标文件
+    if (base != NULL) {
+        bfp = fopen(base, "r");
+        if (bfp == NULL) {
+            fclose(sfp);
+            perror("base fopen()");
+            exit(1);
+        }
+    }
+
     // 打开目标文件
-    dfp = fopen(OUTPUTFILE, "w");
+    dfp = fopen(base != NULL ? OUTPUTTEMP : OUTPUTFILE, "w");
     if (dfp == NULL) {
         fclose(sfp);
         perror("destination fopen()");
@@ -30,17 +111,51 @@ int main() {
         fprintf(stderr, "sort_init()");
         exit(1);
     }
+    if (base == NULL)
+        sort_set_output(ptr, OUTPUTFILE);
+    sort_set_limit(ptr, limit);
+    if (ranged)
+        sort_set_range(ptr, lo, hi);
+    sort_set_combine(ptr, policy);
+    sort_set_checkpoint(ptr, resume);
+    if (every > 0 && sort_set_index(ptr, INDEXFILE, every) < 0) {
+        perror("sort_set_index()");
+        exit(1);
+    }
 
-    // 得到初始归并段
-    get_merge_segments(ptr);
+    if (sample) {
+        // 样本排序：分桶 -> 桶内排序 -> 拼接
+        sampleSort(ptr);
+    } else if (limit >= 0 && bfp == NULL) {
+        // Top-K
+        topKSort(ptr);
+    } else {
+        resumed = resume ? sort_resume(ptr) : -1;
+        if (resumed >= 0) {
+            printf("resumed from merge round %d\n", resumed);
+        } else {
+            // 得到初始归并段
+            get_merge_segments(ptr);
+            printf("presorted fast path: %lld records\n", sort_presorted_items(ptr));
+        }
 
-    // 进行归并排序
-    mergeSort(ptr);
+        // 进行归并排序
+        if (bfp != NULL)
+            mergeIncremental(ptr, bfp);
+        else
+            mergeSort(ptr);
+    }
 
     sort_destory(ptr);
     fclose(dfp);
     fclose(sfp);
-
+    if (bfp != NULL) {
+        fclose(bfp);
+        if (rename(OUTPUTTEMP, OUTPUTFILE) < 0) {
+            perror("rename()");
+            exit(1);
+        }
+    }
 
     exit(0);
 }
\ No newline at end of file
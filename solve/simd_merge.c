@@ -0,0 +1,148 @@
+#include <string.h>
+#include <immintrin.h>
+
+#include "simd_merge.h"
+
+#define AVX2 __attribute__((target("avx2")))
+
+int simd_merge_avx2(void) {
+    static int avx2 = -1;   // 只检测一次，多线程同时检测结果也相同
+
+    if (avx2 < 0) {
+        __builtin_cpu_init();
+        avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+    return avx2;
+}
+
+void simd_merge_scalar(const long long *a, int na, const long long *b, int nb, long long *out) {
+    long long x, y;
+    int ia = 0, ib = 0, io = 0, takeb;
+
+    // 无分支：选择用条件传送完成，下标按比较结果递增
+    while (ia < na && ib < nb) {
+        x = a[ia];
+        y = b[ib];
+        takeb = y < x;
+        out[io++] = takeb ? y : x;
+        ia += 1 - takeb;
+        ib += takeb;
+    }
+    memcpy(out + io, a + ia, (na - ia) * sizeof(*a));
+    io += na - ia;
+    memcpy(out + io, b + ib, (nb - ib) * sizeof(*b));
+}
+
+/**
+ * 比较交换：a中放较小值，b中放较大值
+ */
+static inline AVX2 void minmax(__m256i *a, __m256i *b) {
+    __m256i gt = _mm256_cmpgt_epi64(*a, *b);
+    __m256i mn = _mm256_blendv_epi8(*a, *b, gt);
+    __m256i mx = _mm256_blendv_epi8(*b, *a, gt);
+
+    *a = mn;
+    *b = mx;
+}
+
+/**
+ * 对4个元素的双调序列排序
+ */
+static inline AVX2 __m256i bitonicSort4(__m256i v) {
+    __m256i p;
+
+    // 距离为2的比较交换：[0 1 2 3] 与 [2 3 0 1]
+    p = _mm256_permute4x64_epi64(v, 0x4E);
+    minmax(&v, &p);
+    v = _mm256_blend_epi32(v, p, 0xF0);     // 低两个取小值，高两个取大值
+
+    // 距离为1的比较交换：[0 1 2 3] 与 [1 0 3 2]
+    p = _mm256_permute4x64_epi64(v, 0xB1);
+    minmax(&v, &p);
+    return _mm256_blend_epi32(v, p, 0xCC);  // 偶数位取小值，奇数位取大值
+}
+
+/**
+ * 归并两个有序的4元素向量，lo中为最小的4个，hi中为最大的4个
+ */
+static inline AVX2 void merge8(__m256i a, __m256i b, __m256i *lo, __m256i *hi) {
+    b = _mm256_permute4x64_epi64(b, 0x1B);  // 翻转后 a、b 拼成双调序列
+    minmax(&a, &b);
+    *lo = bitonicSort4(a);
+    *hi = bitonicSort4(b);
+}
+
+static AVX2 void mergeAvx2(const long long *a, int na, const long long *b, int nb, long long *out) {
+    __m256i va, vb, lo, hi;
+    long long rest[4];
+    int ia, ib, io, ir;
+
+    if (na < 4 || nb < 4) {
+        simd_merge_scalar(a, na, b, nb, out);
+        return;
+    }
+
+    va = _mm256_loadu_si256((const __m256i *) a);
+    vb = _mm256_loadu_si256((const __m256i *) b);
+    merge8(va, vb, &lo, &hi);
+    _mm256_storeu_si256((__m256i *) out, lo);
+    ia = ib = io = 4;
+
+    // hi 中始终保存还未输出的4个元素，每次从队头较小的一边再取4个与之归并
+    while (ia + 4 <= na && ib + 4 <= nb) {
+        if (a[ia] <= b[ib]) {
+            va = _mm256_loadu_si256((const __m256i *) (a + ia));
+            ia += 4;
+        } else {
+            va = _mm256_loadu_si256((const __m256i *) (b + ib));
+            ib += 4;
+        }
+        merge8(va, hi, &lo, &hi);
+        _mm256_storeu_si256((__m256i *) (out + io), lo);
+        io += 4;
+    }
+
+    // hi 与 a、b 剩余的不足4个(或另一边剩余的)元素进行标量归并
+    _mm256_storeu_si256((__m256i *) rest, hi);
+    ir = 0;
+    while (ir < 4 || ia < na || ib < nb) {
+        if (ir < 4 && (ia >= na || rest[ir] <= a[ia]) && (ib >= nb || rest[ir] <= b[ib]))
+            out[io++] = rest[ir++];
+        else if (ia < na && (ib >= nb || a[ia] <= b[ib]))
+            out[io++] = a[ia++];
+        else
+            out[io++] = b[ib++];
+    }
+}
+
+void simd_merge(const long long *a, int na, const long long *b, int nb, long long *out) {
+    if (simd_merge_avx2())
+        mergeAvx2(a, na, b, nb, out);
+    else
+        simd_merge_scalar(a, na, b, nb, out);
+}
+
+void simd_merge_segments(long long *buf, const int *lens, int k, long long *tmp) {
+    int n01, n23;
+
+    if (k <= 1)
+        return;
+
+    n01 = lens[0] + lens[1];
+    if (k == 2) {
+        simd_merge(buf, lens[0], buf + lens[0], lens[1], tmp);
+        memcpy(buf, tmp, n01 * sizeof(*buf));
+        return;
+    }
+
+    // 先两两归并到tmp，再归并回buf
+    simd_merge(buf, lens[0], buf + lens[0], lens[1], tmp);
+    if (k == 3) {
+        n23 = lens[2];
+        memcpy(tmp + n01, buf + n01, n23 * sizeof(*buf));
+    } else {
+        n23 = lens[2] + lens[3];
+        simd_merge(buf + n01, lens[2], buf + n01 + lens[2], lens[3], tmp + n01);
+    }
+    simd_merge(tmp, n01, tmp + n01, n23, buf);
+}
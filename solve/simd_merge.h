@@ -0,0 +1,47 @@
+/**
+ * 有序数组的归并内核，用于归并路数较少(2~4路)的情况
+ * 元素为 key 与下标打包成的64位整数：高32位为key，低32位为下标。
+ * 下标用来找回对应的记录，同时保证key相同时按下标的先后输出(归并是稳定的)
+ * CPU支持AVX2时使用双调归并网络，每次输出4个元素；否则使用标量实现(运行时通过CPUID选择)
+ */
+#ifndef DATA_SORT_SIMD_MERGE_H
+#define DATA_SORT_SIMD_MERGE_H
+
+#define SIMD_MERGE_WAYS     4                   // 归并内核支持的最大路数
+
+#define SIMD_PACK(key, index)   ((long long) (key) * 4294967296LL + (unsigned int) (index))
+#define SIMD_KEY(v)             ((int) ((v) >> 32))
+#define SIMD_INDEX(v)           ((unsigned int) (v))
+
+/**
+ * 是否使用AVX2实现
+ * @return 1表示CPU支持AVX2，0表示使用标量实现
+ */
+int simd_merge_avx2(void);
+
+/**
+ * 归并两个有序数组，根据CPU自动选择实现
+ * @param a     有序数组a
+ * @param na    a的长度
+ * @param b     有序数组b
+ * @param nb    b的长度
+ * @param out   结果数组，长度为 na + nb，不能与a、b重叠
+ */
+void simd_merge(const long long *a, int na, const long long *b, int nb, long long *out);
+
+/**
+ * 归并两个有序数组的标量实现
+ * 参数同 simd_merge
+ */
+void simd_merge_scalar(const long long *a, int na, const long long *b, int nb, long long *out);
+
+/**
+ * 将数组中依次存放的k(k <= SIMD_MERGE_WAYS)个有序段归并为一个有序段
+ * @param buf   各有序段依次存放，结果也存放于此
+ * @param lens  各有序段的长度
+ * @param k     有序段个数
+ * @param tmp   不小于buf中元素总数的临时空间
+ */
+void simd_merge_segments(long long *buf, const int *lens, int k, long long *tmp);
+
+#endif //DATA_SORT_SIMD_MERGE_H